@@ -0,0 +1,245 @@
+"""Throughput benchmarks of pywavpack_ext
+
+A synthetic corpus is generated once into --corpus (16/24/32-bit int and float,
+1 to 16 channels, hybrid with a correction file, long and short files), then
+read(), windowed reads, iter_blocks(), read_many() and write() are measured
+across thread counts, i.e. num_threads of read() and of the batch calls, and
+worker_threads (plus one) of read() and write() for libwavpack's own threads.
+MB/s is of the decoded (or encoded) PCM data, i.e.
+frames * channels * bytes per sample.
+
+    python benchmarks/bench.py
+    python benchmarks/bench.py --threads 1,4,16 --json results.json
+
+With --raw, the same files are decoded by benchmarks/raw_decode.c, which uses
+libwavpack only, as the baseline. Build it by adding -DPYWAVPACK_BENCH=ON to
+the CMake arguments.
+"""
+import argparse
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+import numpy as np
+
+import pywavpack.pywavpack_ext as E
+
+RATE = 48000
+
+
+def synth(frames, channels, seed):
+    """A few sines with noise, which compresses like real recordings"""
+    rng = np.random.default_rng(seed)
+    t = np.arange(frames) / RATE
+    signal = np.zeros((frames, channels))
+    for c in range(channels):
+        for freq in rng.uniform(50, 8000, size=3):
+            signal[:, c] += 0.2 * np.sin(2 * np.pi * freq * t + rng.uniform(0, np.pi))
+        signal[:, c] += 0.01 * rng.standard_normal(frames)
+    return signal
+
+
+# name, bits_per_sample ("float" for 32-bit float), channels, seconds,
+# number of files, extra arguments of write()
+CORPUS = [
+    ("int16_stereo", 16, 2, 60, 1, {}),
+    ("int24_stereo", 24, 2, 60, 1, {}),
+    ("int32_stereo", 32, 2, 60, 1, {}),
+    ("float_stereo", "float", 2, 60, 1, {}),
+    ("int16_mono", 16, 1, 60, 1, {}),
+    ("int24_5.1", 24, 6, 30, 1, {}),
+    ("int24_16ch", 24, 16, 10, 1, {}),
+    ("hybrid_wvc", 16, 2, 60, 1, {"bitrate": 4, "wvc": True}),
+    ("short_int16", 16, 1, 0.5, 200, {}),
+]
+
+
+def encode_args(bits):
+    if bits == "float":
+        return {"bits_per_sample": 32, "is_float": True}
+    return {"bits_per_sample": bits}
+
+
+def to_samples(signal, bits):
+    if bits == "float":
+        return signal.astype(np.float32)
+    if bits == 16:
+        return (signal * 32767).astype(np.int16)
+    return (signal * (2.0 ** (bits - 1) - 1)).astype(np.int32)
+
+
+def make_corpus(directory, quick):
+    corpus = {}
+    for name, bits, channels, seconds, count, kwargs in CORPUS:
+        if quick:
+            seconds = min(seconds, 5)
+            count = min(count, 20)
+        paths = []
+        for i in range(count):
+            path = os.path.join(directory, f"{name}_{i}.wv")
+            if not os.path.exists(path):
+                samples = to_samples(synth(int(RATE * seconds), channels, i), bits)
+                E.write(path, samples, RATE, **encode_args(bits), **kwargs)
+            paths.append(path)
+        corpus[name] = (bits, paths)
+    return corpus
+
+
+def pcm_bytes(path):
+    info = E.info(path)
+    return info.num_samples * info.channels * info.bytes_per_sample, info.num_samples * info.channels
+
+
+def measure(fn, repeat):
+    """The best time of "repeat" runs"""
+    best = float("inf")
+    for _ in range(repeat):
+        start = time.perf_counter()
+        fn()
+        best = min(best, time.perf_counter() - start)
+    return best
+
+
+class Results:
+    def __init__(self):
+        self.rows = []
+
+    def add(self, bench, name, threads, seconds, nbytes, samples):
+        row = {
+            "bench": bench,
+            "corpus": name,
+            "threads": threads,
+            "seconds": seconds,
+            "MB/s": nbytes / seconds / 1e6,
+            "Msamples/s": samples / seconds / 1e6,
+        }
+        self.rows.append(row)
+        print(
+            f"{bench:14s} {name:14s} {threads:>7} {row['MB/s']:10.1f} MB/s "
+            f"{row['Msamples/s']:10.1f} Msamples/s",
+            flush=True,
+        )
+
+
+def bench_decode(corpus, threads, repeat, results):
+    for name, (bits, paths) in corpus.items():
+        nbytes, samples = map(sum, zip(*(pcm_bytes(p) for p in paths)))
+        if len(paths) == 1:
+            path = paths[0]
+            for n in threads:
+                t = measure(lambda: E.read(path, num_threads=n), repeat)
+                results.add("read", name, n, t, nbytes, samples)
+
+            # libwavpack's own threads (worker_threads are the additional ones)
+            for n in threads:
+                t = measure(lambda: E.read(path, worker_threads=n - 1), repeat)
+                results.add("read_workers", name, n, t, nbytes, samples)
+
+            dtype = "float32" if bits == "float" else "int16"
+            t = measure(lambda: E.read(path, dtype=dtype), repeat)
+            results.add(f"read_{dtype}", name, 1, t, nbytes, samples)
+
+            # 100 random windows of 0.1 s, with and without the seek index
+            info = E.info(path)
+            frames = RATE // 10
+            starts = np.random.default_rng(0).integers(0, info.num_samples - frames, 100)
+            window_bytes = nbytes * frames * len(starts) // info.num_samples
+            window_samples = samples * frames * len(starts) // info.num_samples
+            for use_index in [False, True]:
+                t = measure(
+                    lambda: [E.read(path, start=int(s), frames=frames, use_index=use_index) for s in starts],
+                    repeat,
+                )
+                bench = "window_index" if use_index else "window"
+                results.add(bench, name, 1, t, window_bytes, window_samples)
+
+            def iterate():
+                with E.WavpackRead(path) as f:
+                    for _ in f.iter_blocks(4096):
+                        pass
+
+            t = measure(iterate, repeat)
+            results.add("iter_blocks", name, 1, t, nbytes, samples)
+        else:
+            for n in threads:
+                t = measure(lambda: E.read_many(paths, num_threads=n), repeat)
+                results.add("read_many", name, n, t, nbytes, samples)
+
+
+def bench_encode(corpus, threads, repeat, results, directory):
+    for name, (bits, paths) in corpus.items():
+        if name.startswith("hybrid"):
+            continue
+        arrays = [E.read(p, dtype="float32" if bits == "float" else "int32")[0] for p in paths]
+        if bits == 16:
+            arrays = [a.astype(np.int16) for a in arrays]
+        nbytes, samples = map(sum, zip(*(pcm_bytes(p) for p in paths)))
+        outs = [os.path.join(directory, f"out_{i}.wv") for i in range(len(arrays))]
+        kwargs = encode_args(bits)
+        if len(arrays) == 1:
+            for n in threads:
+                t = measure(lambda: E.write(outs[0], arrays[0], RATE, worker_threads=n - 1, **kwargs), repeat)
+                results.add("write", name, n, t, nbytes, samples)
+        else:
+            for n in threads:
+                t = measure(lambda: E.write_many(outs, arrays, RATE, num_threads=n, **kwargs), repeat)
+                results.add("write_many", name, n, t, nbytes, samples)
+
+
+def bench_raw(raw, corpus, repeat, results):
+    for name, (_, paths) in corpus.items():
+        if len(paths) != 1:
+            continue
+        output = subprocess.run(
+            [raw, "-r", str(repeat)] + paths, check=True, capture_output=True, text=True
+        ).stdout
+        for line in output.splitlines():
+            r = json.loads(line)
+            samples = r["frames"] * r["channels"]
+            results.add("raw_libwavpack", name, 1, r["seconds"], samples * r["bytes_per_sample"], samples)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--corpus", help="Where the corpus is generated (kept between runs)")
+    parser.add_argument("--threads", default="1,2,4,8", help="Comma-separated numbers of threads")
+    parser.add_argument("--repeat", type=int, default=3)
+    parser.add_argument("--quick", action="store_true", help="A smaller corpus for a smoke test")
+    parser.add_argument("--raw", help="The path to the raw_decode binary")
+    parser.add_argument("--json", help="Save the results to this file")
+    args = parser.parse_args()
+
+    threads = [int(n) for n in args.threads.split(",")]
+    with tempfile.TemporaryDirectory() as tmp:
+        directory = args.corpus or os.path.join(tmp, "corpus")
+        os.makedirs(directory, exist_ok=True)
+        print(f"libwavpack {E.GetLibraryVersionString()}, corpus in {directory}", file=sys.stderr)
+        corpus = make_corpus(directory, args.quick)
+
+        results = Results()
+        E.reset_stats()
+        bench_decode(corpus, threads, args.repeat, results)
+        decode_stats = E.stats()
+        bench_encode(corpus, threads, args.repeat, results, tmp)
+        if args.raw:
+            bench_raw(args.raw, corpus, args.repeat, results)
+
+    # Where the time of the decoding benchmarks went
+    total = decode_stats["unpack_ns"] + decode_stats["convert_ns"] + decode_stats["alloc_ns"]
+    print(json.dumps(decode_stats), file=sys.stderr)
+    if total > 0:
+        print(
+            "decode time: "
+            + ", ".join(f"{k[:-3]} {decode_stats[k] / total:.0%}" for k in ["unpack_ns", "convert_ns", "alloc_ns"]),
+            file=sys.stderr,
+        )
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump({"rows": results.rows, "decode_stats": decode_stats}, f, indent=2)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,78 @@
+// Decode WavPack files with libwavpack only, as the baseline of
+// benchmarks/bench.py. Prints one JSON line per file.
+//
+//     raw_decode [-r repeat] file.wv...
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <wavpack.h>
+
+#define FRAMES_PER_CALL 4096
+
+static double now(void)
+{
+#if defined(_WIN32)
+    return (double) clock () / CLOCKS_PER_SEC;
+#else
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+int main(int argc, char **argv)
+{
+    int repeat = 1, i = 1;
+
+    if (argc > 2 && !strcmp (argv [1], "-r")) {
+        repeat = atoi (argv [2]);
+        i = 3;
+    }
+
+    if (i >= argc || repeat <= 0) {
+        fprintf (stderr, "usage: %s [-r repeat] file.wv...\n", argv [0]);
+        return 1;
+    }
+
+    for (; i < argc; i++) {
+        char error [80];
+        int64_t samples = 0;
+        int channels = 0, bytes_per_sample = 0, r;
+        double best = 0.0, elapsed;
+
+        for (r = 0; r < repeat; r++) {
+            double start = now ();
+            WavpackContext *wpc = WavpackOpenFileInput (argv [i], error, OPEN_WVC, 0);
+            int32_t *buffer;
+            uint32_t n;
+
+            if (!wpc) {
+                fprintf (stderr, "%s: %s\n", argv [i], error);
+                return 1;
+            }
+
+            channels = WavpackGetNumChannels (wpc);
+            bytes_per_sample = WavpackGetBytesPerSample (wpc);
+            buffer = malloc (sizeof (int32_t) * FRAMES_PER_CALL * channels);
+            samples = 0;
+
+            while ((n = WavpackUnpackSamples (wpc, buffer, FRAMES_PER_CALL)) > 0)
+                samples += n;
+
+            free (buffer);
+            WavpackCloseFile (wpc);
+            elapsed = now () - start;
+
+            if (r == 0 || elapsed < best)
+                best = elapsed;
+        }
+
+        printf ("{\"file\": \"%s\", \"seconds\": %.9f, \"frames\": %lld, \"channels\": %d, \"bytes_per_sample\": %d}\n",
+            argv [i], best, (long long) samples, channels, bytes_per_sample);
+    }
+
+    return 0;
+}
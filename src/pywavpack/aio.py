@@ -0,0 +1,143 @@
+"""asyncio interface of pywavpack_ext
+
+The files are decoded on native threads without the GIL, and the event loop
+is only woken up to receive the results, so that it's never blocked by I/O
+nor decoding.
+
+    from pywavpack import aio
+
+    array, rate = await aio.aread("test.wv")
+
+    reader = aio.AsyncWavpackRead("test.wv")
+    async for chunk in reader.iter_blocks(48000):
+        ...
+"""
+import asyncio
+import weakref
+
+from . import pywavpack_ext as _E
+
+
+def _resolve(future, result, error):
+    if future.done():
+        # Cancelled while decoding
+        return
+    if error is not None:
+        future.set_exception(error)
+    else:
+        future.set_result(result)
+
+
+async def aread(infilename, **kwargs):
+    """Decode a file in the same way as read() without blocking the event loop
+
+    The keyword arguments are the same as read(). Returns (array, sample_rate).
+    """
+    loop = asyncio.get_running_loop()
+    future = loop.create_future()
+
+    def callback(result, error):
+        # Called from a native thread with the GIL
+        try:
+            loop.call_soon_threadsafe(_resolve, future, result, error)
+        except RuntimeError:
+            # The loop is already closed
+            pass
+
+    _E.read_async(callback, str(infilename), **kwargs)
+    return await future
+
+
+class AsyncBlockIterator:
+    """Yield chunks of frames_per_block frames decoded ahead by a native thread
+
+    Up to "prefetch" chunks are decoded before they are awaited. The last chunk
+    is shorter at the end of the file.
+    """
+
+    def __init__(self, infilename, frames_per_block, prefetch=4, **kwargs):
+        self._loop = asyncio.get_running_loop()
+        self._waiter = None
+
+        # The native thread holds only a weak reference to the iterator, so
+        # that dropping the iterator stops the thread
+        ref = weakref.ref(self)
+
+        def notify():
+            it = ref()
+            if it is not None:
+                it._notify()
+
+        self._prefetcher = _E.BlockPrefetcher(
+            str(infilename), frames_per_block, notify, prefetch=prefetch, **kwargs
+        )
+
+    def _notify(self):
+        # Called from the native thread with the GIL
+        try:
+            self._loop.call_soon_threadsafe(self._wake)
+        except RuntimeError:
+            pass
+
+    def _wake(self):
+        if self._waiter is not None and not self._waiter.done():
+            self._waiter.set_result(None)
+
+    def __aiter__(self):
+        return self
+
+    async def __anext__(self):
+        while True:
+            # Created before polling, so that a chunk queued right after the
+            # poll wakes up this waiter
+            self._waiter = self._loop.create_future()
+            try:
+                chunk = self._prefetcher.poll()
+            except StopIteration:
+                self.close()
+                raise StopAsyncIteration
+            if chunk is not None:
+                return chunk
+            await self._waiter
+
+    def close(self):
+        self._prefetcher.close()
+
+    async def aclose(self):
+        self.close()
+
+
+class AsyncWavpackRead:
+    """The asyncio counterpart of WavpackRead
+
+    The file is opened by each read() or iter_blocks() on a native thread.
+    """
+
+    def __init__(self, infilename, flags=_E.OPEN_WVC, norm_offset=0, worker_threads=0):
+        self.infilename = str(infilename)
+        self.flags = flags
+        self.norm_offset = norm_offset
+        self.worker_threads = worker_threads
+
+    async def read(self, start=0, frames=-1, dtype="int32"):
+        return await aread(
+            self.infilename,
+            flags=self.flags,
+            norm_offset=self.norm_offset,
+            start=start,
+            frames=frames,
+            dtype=dtype,
+            worker_threads=self.worker_threads,
+        )
+
+    def iter_blocks(self, frames_per_block, dtype="int32", start=0, prefetch=4):
+        return AsyncBlockIterator(
+            self.infilename,
+            frames_per_block,
+            prefetch=prefetch,
+            dtype=dtype,
+            start=start,
+            flags=self.flags,
+            norm_offset=self.norm_offset,
+            worker_threads=self.worker_threads,
+        )
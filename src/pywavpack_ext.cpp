@@ -1,16 +1,52 @@
 #include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <tuple>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include <nanobind/nanobind.h>
 #include <nanobind/ndarray.h>
+#include <nanobind/stl/map.h>
+#include <nanobind/stl/shared_ptr.h>
+#include <nanobind/stl/string.h>
 #include <nanobind/stl/tuple.h>
+#include <nanobind/stl/vector.h>
 
 #include <wavpack.h>
 
+#include <sys/stat.h>
+#include <sys/types.h>
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 namespace nb = nanobind;
 
 using namespace nb::literals;
@@ -18,11 +54,128 @@ using namespace nb::literals;
 #define CLEAR(destin) memset (&destin, 0, sizeof (destin));
 
 typedef struct {
-    uint32_t bytes_written, first_block_size;
-    FILE *file;
-    int error;
+    uint32_t bytes_written = 0, first_block_size = 0;
+    FILE *file = NULL;
+    int error = 0;
+    // Added to the CLI version: the blocks are accumulated in "buffer" and
+    // written by one fwrite when it's full, and a copy of the first block is
+    // kept to update the number of samples when the file is closed.
+    std::vector<unsigned char> buffer;
+    std::vector<unsigned char> first_block;
+    // If true, there is no file and the whole stream is kept in "buffer"
+    bool in_memory = false;
 } write_id;
 
+// The size of write_id::buffer
+static const size_t write_buffer_size = 4 << 20;
+
+
+// MD5 (RFC 1321) to store and verify the checksum of the audio data.
+// libwavpack only stores the digest given by the application, and cli/md5.c
+// isn't a part of the library, so this is a minimal reimplementation.
+struct MD5Context {
+    uint32_t state[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    uint64_t length = 0;
+    unsigned char block[64];
+
+    void update(const void *data, size_t size) {
+        auto *p = static_cast<const unsigned char *>(data);
+        auto used = static_cast<size_t>(length % 64);
+        length += size;
+        if (used) {
+            auto n = std::min(size, 64 - used);
+            std::memcpy(block + used, p, n);
+            p += n;
+            size -= n;
+            if (used + n < 64) {
+                return;
+            }
+            transform(block);
+        }
+        for (; size >= 64; p += 64, size -= 64) {
+            transform(p);
+        }
+        std::memcpy(block, p, size);
+    };
+
+    void final(unsigned char digest[16]) {
+        unsigned char bits[8];
+        for (int i = 0; i < 8; i++) {
+            bits[i] = static_cast<unsigned char>((length * 8) >> (8 * i));
+        }
+        static const unsigned char padding[64] = {0x80};
+        auto used = static_cast<size_t>(length % 64);
+        update(padding, used < 56 ? 56 - used : 120 - used);
+        update(bits, 8);
+        for (int i = 0; i < 16; i++) {
+            digest[i] =
+                static_cast<unsigned char>(state[i / 4] >> (8 * (i % 4)));
+        }
+    };
+
+  private:
+    static uint32_t rotl(uint32_t x, int n) {
+        return (x << n) | (x >> (32 - n));
+    };
+
+    void transform(const unsigned char *p) {
+        static const uint32_t k[64] = {
+            0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf,
+            0x4787c62a, 0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af,
+            0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e,
+            0x49b40821, 0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+            0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8, 0x21e1cde6,
+            0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+            0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122,
+            0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+            0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039,
+            0xe6db99e5, 0x1fa27cf8, 0xc4ac5665, 0xf4292244, 0x432aff97,
+            0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d,
+            0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+            0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+        static const int r[64] = {
+            7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+            5, 9,  14, 20, 5, 9,  14, 20, 5, 9,  14, 20, 5, 9,  14, 20,
+            4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+            6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21};
+
+        uint32_t m[16];
+        for (int i = 0; i < 16; i++) {
+            m[i] = static_cast<uint32_t>(p[i * 4]) |
+                   (static_cast<uint32_t>(p[i * 4 + 1]) << 8) |
+                   (static_cast<uint32_t>(p[i * 4 + 2]) << 16) |
+                   (static_cast<uint32_t>(p[i * 4 + 3]) << 24);
+        }
+        auto a = state[0], b = state[1], c = state[2], d = state[3];
+        for (int i = 0; i < 64; i++) {
+            uint32_t f;
+            int g;
+            if (i < 16) {
+                f = (b & c) | (~b & d);
+                g = i;
+            } else if (i < 32) {
+                f = (d & b) | (~d & c);
+                g = (5 * i + 1) % 16;
+            } else if (i < 48) {
+                f = b ^ c ^ d;
+                g = (3 * i + 5) % 16;
+            } else {
+                f = c ^ (b | ~d);
+                g = (7 * i) % 16;
+            }
+            auto tmp = d;
+            d = c;
+            c = b;
+            b = b + rotl(a + f + k[i] + m[g], r[i]);
+            a = tmp;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+    };
+};
+
 
 // Ref: https://pyopyopyo.hatenablog.com/entry/2019/02/08/102456
 template <typename... Args>
@@ -75,28 +228,51 @@ static int DoCloseHandle (FILE *hFile)
     return hFile ? !fclose (hFile) : 0;
 }
 
-// Copy from cli/wavpack.c
-static int write_block (void *id, void *data, int32_t length)
+// Write out the blocks accumulated by write_block()
+static int flush_block_buffer (write_id *wid)
 {
-    write_id *wid = (write_id *) id;
     uint32_t bcount;
 
     if (wid->error)
         return false;
 
-    if (wid && wid->file && data && length) {
-        if (!DoWriteFile (wid->file, data, length, &bcount) || bcount != length) {
+    if (wid->in_memory)
+        return true;
+
+    if (wid->file && !wid->buffer.empty ()) {
+        if (!DoWriteFile (wid->file, wid->buffer.data (), (uint32_t) wid->buffer.size (), &bcount) ||
+            bcount != wid->buffer.size ()) {
             DoTruncateFile (wid->file);
             DoCloseHandle (wid->file);
             wid->file = NULL;
             wid->error = 1;
             return false;
         }
-        else {
-            wid->bytes_written += length;
+    }
+
+    wid->buffer.clear ();
+    return true;
+}
+
+// Copy from cli/wavpack.c, modified to write through write_id::buffer
+static int write_block (void *id, void *data, int32_t length)
+{
+    write_id *wid = (write_id *) id;
+    unsigned char *bytes = (unsigned char *) data;
+
+    if (wid->error)
+        return false;
 
-            if (!wid->first_block_size)
-                wid->first_block_size = bcount;
+    if (wid && (wid->file || wid->in_memory) && data && length) {
+        if (wid->buffer.size () + length > write_buffer_size && !flush_block_buffer (wid))
+            return false;
+
+        wid->buffer.insert (wid->buffer.end (), bytes, bytes + length);
+        wid->bytes_written += length;
+
+        if (!wid->first_block_size) {
+            wid->first_block_size = length;
+            wid->first_block.assign (bytes, bytes + length);
         }
     }
 
@@ -105,6 +281,556 @@ static int write_block (void *id, void *data, int32_t length)
 
 
 
+// Per-process counters to attribute the time spent in this module without a
+// profiler. They are relaxed atomics updated once per call of the library,
+// not per sample, so they are always enabled.
+struct PerfCounters {
+    std::atomic<int64_t> files_opened{0};
+    // Exact for the streams read by this module (memory, seek index windows,
+    // shards and transcoding). For files opened by path, which are read by
+    // the library itself, estimated from the fraction of the samples decoded.
+    std::atomic<int64_t> bytes_read{0};
+    // Counted from the block size of the file, i.e. exact unless the blocks
+    // have different sizes
+    std::atomic<int64_t> blocks_decoded{0};
+    std::atomic<int64_t> samples_decoded{0};
+    std::atomic<int64_t> samples_encoded{0};
+    std::atomic<int64_t> seeks{0};
+    std::atomic<int64_t> unpack_ns{0};
+    std::atomic<int64_t> convert_ns{0};
+    std::atomic<int64_t> alloc_ns{0};
+    std::atomic<int64_t> pack_ns{0};
+};
+
+static PerfCounters &perf_counters = *new PerfCounters();
+
+// Add the time from the construction to the destruction to "counter"
+struct ScopedTimer {
+    std::atomic<int64_t> &counter;
+    std::chrono::steady_clock::time_point start;
+
+    explicit ScopedTimer(std::atomic<int64_t> &counter)
+        : counter(counter), start(std::chrono::steady_clock::now()) {};
+    ~ScopedTimer() {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        counter.fetch_add(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+                .count(),
+            std::memory_order_relaxed);
+    };
+};
+
+static void add_counter(std::atomic<int64_t> &counter, int64_t value) {
+    counter.fetch_add(value, std::memory_order_relaxed);
+};
+
+
+// A read-only stream over memory, which is owned by somebody else
+struct MemoryStream {
+    const uint8_t *data;
+    int64_t size;
+    int64_t pos;
+};
+
+// The callbacks of WavpackStreamReader64 for MemoryStream. They follow the
+// semantics of the stdio functions like the file reader in the library.
+static int32_t memory_read_bytes(void *id, void *data, int32_t bcount) {
+    auto *stream = static_cast<MemoryStream *>(id);
+    auto n = std::min(static_cast<int64_t>(bcount),
+                      std::max(stream->size - stream->pos, (int64_t)0));
+    if (n > 0) {
+        std::memcpy(data, stream->data + stream->pos, n);
+        stream->pos += n;
+        add_counter(perf_counters.bytes_read, n);
+    }
+    return static_cast<int32_t>(n);
+}
+
+static int32_t memory_write_bytes(void *, void *, int32_t) { return 0; }
+
+static int64_t memory_get_pos(void *id) {
+    return static_cast<MemoryStream *>(id)->pos;
+}
+
+static int memory_set_pos_abs(void *id, int64_t pos) {
+    auto *stream = static_cast<MemoryStream *>(id);
+    if (pos < 0) {
+        return -1;
+    }
+    stream->pos = pos;
+    return 0;
+}
+
+static int memory_set_pos_rel(void *id, int64_t delta, int mode) {
+    auto *stream = static_cast<MemoryStream *>(id);
+    int64_t base = 0;
+    if (mode == SEEK_CUR) {
+        base = stream->pos;
+    } else if (mode == SEEK_END) {
+        base = stream->size;
+    }
+    return memory_set_pos_abs(id, base + delta);
+}
+
+static int memory_push_back_byte(void *id, int c) {
+    auto *stream = static_cast<MemoryStream *>(id);
+    if (stream->pos <= 0) {
+        return EOF;
+    }
+    stream->pos--;
+    return c;
+}
+
+static int64_t memory_get_length(void *id) {
+    return static_cast<MemoryStream *>(id)->size;
+}
+
+static int memory_can_seek(void *) { return 1; }
+
+static int memory_truncate_here(void *) { return -1; }
+
+static int memory_close(void *) { return 0; }
+
+static WavpackStreamReader64 memory_reader = {
+    memory_read_bytes,     memory_write_bytes, memory_get_pos,
+    memory_set_pos_abs,    memory_set_pos_rel, memory_push_back_byte,
+    memory_get_length,     memory_can_seek,    memory_truncate_here,
+    memory_close,
+};
+
+
+// Holds a Py_buffer of any object supporting the buffer protocol, e.g. bytes,
+// bytearray, memoryview, numpy.ndarray and mmap.mmap, so that the memory is
+// neither freed nor resized while it is read. The GIL is needed to construct
+// and destruct it.
+struct PythonBuffer {
+    Py_buffer view;
+
+    PythonBuffer(nb::handle obj) {
+        if (PyObject_GetBuffer(obj.ptr(), &view, PyBUF_SIMPLE) != 0) {
+            throw nb::python_error();
+        }
+    };
+    ~PythonBuffer() { PyBuffer_Release(&view); };
+    PythonBuffer(const PythonBuffer &) = delete;
+    PythonBuffer &operator=(const PythonBuffer &) = delete;
+
+    auto data() const { return static_cast<const uint8_t *>(view.buf); };
+    auto size() const { return static_cast<size_t>(view.len); };
+};
+
+
+// fseek/stat for files larger than 2GB
+static int file_seek(FILE *file, int64_t offset) {
+#if defined(_WIN32)
+    return _fseeki64(file, offset, SEEK_SET);
+#else
+    return fseeko(file, static_cast<off_t>(offset), SEEK_SET);
+#endif
+}
+
+static bool file_stat(const char *filename, int64_t *size, int64_t *mtime) {
+#if defined(_WIN32)
+    struct _stat64 st;
+    if (_stat64(filename, &st) != 0) {
+        return false;
+    }
+#else
+    struct stat st;
+    if (stat(filename, &st) != 0) {
+        return false;
+    }
+#endif
+    *size = static_cast<int64_t>(st.st_size);
+    *mtime = static_cast<int64_t>(st.st_mtime);
+    return true;
+}
+
+// A file is written to a temporary file next to it and renamed when it's
+// complete, so that a failure or a concurrent writer doesn't leave a torn
+// file behind
+static std::string temp_filename(const char *filename) {
+    return _format("%s.%llx.tmp", filename,
+                   static_cast<unsigned long long>(std::random_device()()) ^
+                       std::hash<std::thread::id>()(
+                           std::this_thread::get_id()));
+}
+
+// Replace "filename" with "temp". "temp" is removed on a failure.
+static void rename_temp_file(const std::string &temp, const char *filename) {
+    std::error_code ec;
+    std::filesystem::rename(temp, filename, ec);
+    if (ec) {
+        std::remove(temp.c_str());
+        throw std::runtime_error(_format("Failed to write %s: %s", filename,
+                                         ec.message().c_str()));
+    }
+}
+
+
+// A read-only stream over a range of a file from "base" to the end, read
+// through a window buffer. When a seek index is used, the window is set to
+// the size of the target block so that the block is fetched by one read.
+struct FileStream {
+    FILE *file;
+    int64_t base;
+    int64_t length;
+    int64_t pos;
+    std::vector<uint8_t> window;
+    int64_t window_start;
+    size_t window_size;
+    // The number of bytes read at once
+    size_t capacity;
+
+    void reset(int64_t new_base, int64_t file_size, size_t first_read) {
+        base = new_base;
+        length = file_size - new_base;
+        pos = 0;
+        window_start = 0;
+        window_size = 0;
+        capacity = std::max(first_read, static_cast<size_t>(64 << 10));
+    };
+};
+
+static int32_t file_read_bytes(void *id, void *data, int32_t bcount) {
+    auto *stream = static_cast<FileStream *>(id);
+    auto *out = static_cast<uint8_t *>(data);
+    int32_t total = 0;
+    while (bcount > 0 && stream->pos < stream->length) {
+        auto offset = stream->pos - stream->window_start;
+        if (offset < 0 || offset >= static_cast<int64_t>(stream->window_size)) {
+            // Refill the window from the current position
+            auto n = static_cast<size_t>(std::min(
+                static_cast<int64_t>(std::max(
+                    stream->capacity, static_cast<size_t>(bcount))),
+                stream->length - stream->pos));
+            stream->window.resize(n);
+            if (file_seek(stream->file, stream->base + stream->pos) != 0) {
+                break;
+            }
+            stream->window_start = stream->pos;
+            stream->window_size =
+                fread(stream->window.data(), 1, n, stream->file);
+            add_counter(perf_counters.bytes_read, stream->window_size);
+            if (stream->window_size == 0) {
+                break;
+            }
+            offset = 0;
+        }
+        auto n = std::min(static_cast<int64_t>(bcount),
+                          static_cast<int64_t>(stream->window_size) - offset);
+        std::memcpy(out + total, stream->window.data() + offset, n);
+        stream->pos += n;
+        total += static_cast<int32_t>(n);
+        bcount -= static_cast<int32_t>(n);
+    }
+    return total;
+}
+
+static int64_t file_get_pos(void *id) {
+    return static_cast<FileStream *>(id)->pos;
+}
+
+static int file_set_pos_abs(void *id, int64_t pos) {
+    if (pos < 0) {
+        return -1;
+    }
+    static_cast<FileStream *>(id)->pos = pos;
+    return 0;
+}
+
+static int file_set_pos_rel(void *id, int64_t delta, int mode) {
+    auto *stream = static_cast<FileStream *>(id);
+    int64_t base = 0;
+    if (mode == SEEK_CUR) {
+        base = stream->pos;
+    } else if (mode == SEEK_END) {
+        base = stream->length;
+    }
+    return file_set_pos_abs(id, base + delta);
+}
+
+static int file_push_back_byte(void *id, int c) {
+    auto *stream = static_cast<FileStream *>(id);
+    if (stream->pos <= 0) {
+        return EOF;
+    }
+    stream->pos--;
+    return c;
+}
+
+static int64_t file_get_length(void *id) {
+    return static_cast<FileStream *>(id)->length;
+}
+
+static WavpackStreamReader64 file_reader = {
+    file_read_bytes,     memory_write_bytes, file_get_pos,
+    file_set_pos_abs,    file_set_pos_rel,   file_push_back_byte,
+    file_get_length,     memory_can_seek,    memory_truncate_here,
+    memory_close,
+};
+
+
+// Little-endian serialization for the sidecar file of WavpackSeekIndex
+static void put_le(std::vector<unsigned char> &out, uint64_t value,
+                   int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        out.push_back(static_cast<unsigned char>(value >> (8 * i)));
+    }
+}
+
+static uint64_t get_le(const unsigned char *in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value |= static_cast<uint64_t>(in[i]) << (8 * i);
+    }
+    return value;
+}
+
+
+// Maps sample ranges to the byte ranges of the blocks, built by reading only
+// the block headers. A multichannel file has several blocks per sample range
+// (from INITIAL_BLOCK to FINAL_BLOCK), which are stored as one entry.
+struct WavpackSeekIndex {
+    struct Entry {
+        int64_t block_index;
+        int64_t offset;
+        uint32_t block_samples;
+        uint32_t size;
+    };
+    std::vector<Entry> entries;
+    int64_t total_samples = 0;
+    // To detect that the file was modified
+    int64_t file_size = 0;
+    int64_t mtime = 0;
+
+    // Returns the position of the entry containing "sample", or -1
+    int64_t find(int64_t sample) const {
+        auto it = std::upper_bound(
+            entries.begin(), entries.end(), sample,
+            [](int64_t s, const Entry &e) { return s < e.block_index; });
+        if (it == entries.begin()) {
+            return -1;
+        }
+        --it;
+        if (sample >= it->block_index + it->block_samples) {
+            return -1;
+        }
+        return it - entries.begin();
+    };
+
+    // read_at(offset, buffer, size) reads "size" bytes at "offset" and
+    // returns the number of bytes read. The scan stops at the first position
+    // which is not a WavPack block, e.g. an APEv2 tag at the end.
+    template <typename ReadAt>
+    static std::shared_ptr<WavpackSeekIndex> scan(ReadAt read_at,
+                                                  int64_t size) {
+        auto index = std::make_shared<WavpackSeekIndex>();
+        index->file_size = size;
+        char format[] = WavpackHeaderFormat;
+        int64_t pos = 0;
+        while (pos + static_cast<int64_t>(sizeof(WavpackHeader)) <= size) {
+            WavpackHeader header;
+            if (read_at(pos, &header, sizeof(header)) != sizeof(header) ||
+                std::memcmp(header.ckID, "wvpk", 4) != 0) {
+                break;
+            }
+            WavpackLittleEndianToNative(&header, format);
+            if (header.ckSize < sizeof(header) - 8 ||
+                header.ckSize > (1 << 25)) {
+                break;
+            }
+            if (header.flags & DSD_FLAG) {
+                throw std::runtime_error(
+                    "The seek index doesn't support DSD audio");
+            }
+            auto block_size = header.ckSize + 8;
+            if (header.block_samples > 0) {
+                if ((header.flags & INITIAL_BLOCK) || index->entries.empty()) {
+                    index->entries.push_back(Entry{GET_BLOCK_INDEX(header),
+                                                   pos, header.block_samples,
+                                                   block_size});
+                } else {
+                    index->entries.back().size += block_size;
+                }
+            }
+            pos += block_size;
+        }
+        if (index->entries.empty()) {
+            throw std::runtime_error("No WavPack block was found");
+        }
+        auto &last = index->entries.back();
+        index->total_samples = last.block_index + last.block_samples;
+        return index;
+    };
+
+    static std::shared_ptr<WavpackSeekIndex> build(const char *infilename) {
+        int64_t size, mtime;
+        if (!file_stat(infilename, &size, &mtime)) {
+            throw std::runtime_error(
+                _format("Failed to stat %s", infilename));
+        }
+        std::unique_ptr<FILE, int (*)(FILE *)> file(fopen(infilename, "rb"),
+                                                   fclose);
+        if (!file) {
+            throw std::runtime_error(
+                _format("Failed to open %s", infilename));
+        }
+        auto index = scan(
+            [&](int64_t offset, void *buffer, size_t n) -> size_t {
+                if (file_seek(file.get(), offset) != 0) {
+                    return 0;
+                }
+                return fread(buffer, 1, n, file.get());
+            },
+            size);
+        index->mtime = mtime;
+        return index;
+    };
+
+    static std::shared_ptr<WavpackSeekIndex> build_from_memory(
+        const uint8_t *data, size_t size) {
+        return scan(
+            [&](int64_t offset, void *buffer, size_t n) -> size_t {
+                n = static_cast<size_t>(std::min(
+                    static_cast<int64_t>(n),
+                    static_cast<int64_t>(size) - offset));
+                std::memcpy(buffer, data + offset, n);
+                return n;
+            },
+            static_cast<int64_t>(size));
+    };
+
+    // The sidecar file: "WVIX", version (u32), file_size, mtime,
+    // total_samples (i64), the number of entries (u64) and the entries
+    // (block_index, offset: i64, block_samples, size: u32) in little-endian
+    void save(const char *filename) const {
+        std::vector<unsigned char> out = {'W', 'V', 'I', 'X'};
+        put_le(out, 1, 4);
+        put_le(out, file_size, 8);
+        put_le(out, mtime, 8);
+        put_le(out, total_samples, 8);
+        put_le(out, entries.size(), 8);
+        for (auto &e : entries) {
+            put_le(out, e.block_index, 8);
+            put_le(out, e.offset, 8);
+            put_le(out, e.block_samples, 4);
+            put_le(out, e.size, 4);
+        }
+        auto temp = temp_filename(filename);
+        {
+            std::unique_ptr<FILE, int (*)(FILE *)> file(
+                fopen(temp.c_str(), "wb"), fclose);
+            uint32_t bcount;
+            if (!file ||
+                !DoWriteFile(file.get(), out.data(),
+                             static_cast<uint32_t>(out.size()), &bcount) ||
+                bcount != out.size() || fclose(file.release()) != 0) {
+                std::remove(temp.c_str());
+                throw std::runtime_error(
+                    _format("Failed to write %s", filename));
+            }
+        }
+        rename_temp_file(temp, filename);
+    };
+
+    static std::shared_ptr<WavpackSeekIndex> load(const char *filename) {
+        std::unique_ptr<FILE, int (*)(FILE *)> file(fopen(filename, "rb"),
+                                                   fclose);
+        if (!file) {
+            throw std::runtime_error(_format("Failed to open %s", filename));
+        }
+        unsigned char header[44];
+        if (fread(header, 1, sizeof(header), file.get()) != sizeof(header) ||
+            std::memcmp(header, "WVIX", 4) != 0 || get_le(header + 4, 4) != 1) {
+            throw std::runtime_error(
+                _format("%s is not a seek index", filename));
+        }
+        auto index = std::make_shared<WavpackSeekIndex>();
+        index->file_size = static_cast<int64_t>(get_le(header + 8, 8));
+        index->mtime = static_cast<int64_t>(get_le(header + 16, 8));
+        index->total_samples = static_cast<int64_t>(get_le(header + 24, 8));
+        // The count is checked against the size of the file before
+        // allocating, because a broken file may have any value
+        auto count = get_le(header + 32, 8);
+        int64_t size, mtime;
+        if (!file_stat(filename, &size, &mtime)) {
+            throw std::runtime_error(_format("Failed to stat %s", filename));
+        }
+        if (count > static_cast<uint64_t>(size - sizeof(header)) / 24) {
+            throw std::runtime_error(_format("%s is truncated", filename));
+        }
+        std::vector<unsigned char> body(count * 24);
+        if (fread(body.data(), 1, body.size(), file.get()) != body.size()) {
+            throw std::runtime_error(_format("%s is truncated", filename));
+        }
+        index->entries.resize(count);
+        for (size_t i = 0; i < count; i++) {
+            auto *p = body.data() + i * 24;
+            index->entries[i] = Entry{static_cast<int64_t>(get_le(p, 8)),
+                                      static_cast<int64_t>(get_le(p + 8, 8)),
+                                      static_cast<uint32_t>(get_le(p + 16, 4)),
+                                      static_cast<uint32_t>(get_le(p + 20, 4))};
+        }
+        return index;
+    };
+};
+
+
+// The seek indexes built so far, keyed by the path. An entry is rebuilt if
+// the size or mtime of the file changed.
+static std::mutex seek_index_mutex;
+static std::map<std::string, std::shared_ptr<WavpackSeekIndex>> seek_index_cache;
+
+// Get the seek index of "infilename" from the cache, from "sidecar" if it's
+// not empty and up to date, or by building it. A newly built index is saved
+// to "sidecar". If the file is already mapped, "data" is scanned instead of
+// reading the file. This doesn't touch any Python object.
+static std::shared_ptr<WavpackSeekIndex>
+get_seek_index(const std::string &infilename, const std::string &sidecar,
+               const uint8_t *data = nullptr, size_t data_size = 0) {
+    int64_t size, mtime;
+    if (!file_stat(infilename.c_str(), &size, &mtime)) {
+        throw std::runtime_error(
+            _format("Failed to stat %s", infilename.c_str()));
+    }
+    auto is_valid = [&](const std::shared_ptr<WavpackSeekIndex> &index) {
+        return index && index->file_size == size && index->mtime == mtime;
+    };
+    {
+        std::lock_guard<std::mutex> lock(seek_index_mutex);
+        auto it = seek_index_cache.find(infilename);
+        if (it != seek_index_cache.end() && is_valid(it->second)) {
+            return it->second;
+        }
+    }
+
+    std::shared_ptr<WavpackSeekIndex> index;
+    if (!sidecar.empty()) {
+        try {
+            index = WavpackSeekIndex::load(sidecar.c_str());
+        } catch (const std::exception &) {
+            index = nullptr;
+        }
+    }
+    if (!is_valid(index)) {
+        if (data != nullptr && static_cast<int64_t>(data_size) == size) {
+            index = WavpackSeekIndex::build_from_memory(data, data_size);
+            index->mtime = mtime;
+        } else {
+            index = WavpackSeekIndex::build(infilename.c_str());
+        }
+        if (!sidecar.empty()) {
+            index->save(sidecar.c_str());
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(seek_index_mutex);
+    seek_index_cache[infilename] = index;
+    return index;
+};
+
+
 struct WavpackRead {
   private:
     // FIXME(kamo):
@@ -114,6 +840,92 @@ struct WavpackRead {
     void *_wpc;
     char _error[80];
     std::string _filename;
+    int _flags;
+    int _norm_offset;
+    // Only used when reading from memory
+    std::unique_ptr<MemoryStream> _wv_stream;
+    std::unique_ptr<MemoryStream> _wvc_stream;
+    std::unique_ptr<PythonBuffer> _wv_buffer;
+    std::unique_ptr<PythonBuffer> _wvc_buffer;
+    // Only used when a seek index is set. The context is reopened in the
+    // streaming mode at the block found in the index, so that the sample
+    // index of the context is relative to _base_sample.
+    std::shared_ptr<WavpackSeekIndex> _index;
+    std::unique_ptr<FileStream> _seek_file;
+    std::unique_ptr<MemoryStream> _seek_memory;
+    int64_t _base_sample = 0;
+    // True while the file opened by path is read by the library itself,
+    // whose reads are estimated for PerfCounters::bytes_read
+    bool _library_file = false;
+    // The last block counted in PerfCounters::blocks_decoded, and the size
+    // of the blocks, which is the largest one seen because the last block of
+    // the file is shorter
+    int64_t _last_block = -1;
+    int64_t _block_samples = 0;
+    // See Lock()
+    std::mutex _mutex;
+
+    int _seek_with_index(int64_t sample) {
+        auto i = _index->find(sample);
+        if (i < 0) {
+            return false;
+        }
+        auto &entry = _index->entries[i];
+
+        if (_wpc != nullptr) {
+            WavpackCloseFile(static_cast<WavpackContext *>(_wpc));
+            _wpc = nullptr;
+        }
+        void *stream;
+        WavpackStreamReader64 *reader;
+        if (_wv_stream) {
+            _seek_memory.reset(new MemoryStream{
+                _wv_stream->data + entry.offset,
+                _wv_stream->size - entry.offset, 0});
+            stream = _seek_memory.get();
+            reader = &memory_reader;
+        } else {
+            if (!_seek_file) {
+                auto *file = fopen(_filename.c_str(), "rb");
+                if (file == nullptr) {
+                    return false;
+                }
+                _seek_file.reset(new FileStream());
+                _seek_file->file = file;
+            }
+            _seek_file->reset(entry.offset, _index->file_size, entry.size);
+            stream = _seek_file.get();
+            reader = &file_reader;
+        }
+        // In the streaming mode, the library decodes the blocks from the
+        // current position without looking for the beginning of the file
+        _wpc = WavpackOpenFileInputEx64(
+            reader, stream, nullptr, _error,
+            (_flags | OPEN_STREAMING) & ~(OPEN_WVC | OPEN_TAGS), _norm_offset);
+        _library_file = false;
+        if (_wpc == nullptr) {
+            return false;
+        }
+        _base_sample = entry.block_index;
+        _last_block = -1;
+
+        // Skip the samples before the target in the block
+        auto skip = sample - entry.block_index;
+        std::vector<int32_t> buffer(
+            std::min(skip, static_cast<int64_t>(4096)) *
+            WavpackGetNumChannels(static_cast<WavpackContext *>(_wpc)));
+        while (skip > 0) {
+            auto n = std::min(skip, static_cast<int64_t>(4096));
+            auto ret = WavpackUnpackSamples(static_cast<WavpackContext *>(_wpc),
+                                            buffer.data(),
+                                            static_cast<uint32_t>(n));
+            if (ret == 0) {
+                return false;
+            }
+            skip -= ret;
+        }
+        return true;
+    };
 
   public:
     WavpackRead(const char *infilename, int flags, int norm_offset) {
@@ -138,7 +950,50 @@ struct WavpackRead {
         //         of -32768.0 (assuming no clipping samples).
         _error[0] = '\0';
         _wpc = WavpackOpenFileInput(infilename, _error, flags, norm_offset);
+        if (_wpc != nullptr) {
+            add_counter(perf_counters.files_opened, 1);
+            _library_file = true;
+        }
         _filename = infilename;
+        _flags = flags;
+        _norm_offset = norm_offset;
+    };
+
+    // Decode the WavPack stream in "data" (and the correction stream in
+    // "wvc_data" if not NULL) without copying it. The memory must stay valid
+    // until the file is closed.
+    WavpackRead(const void *data, size_t size, const void *wvc_data,
+                size_t wvc_size, int flags, int norm_offset) {
+        _wv_stream.reset(new MemoryStream{
+            static_cast<const uint8_t *>(data), static_cast<int64_t>(size),
+            0});
+        if (wvc_data != nullptr) {
+            _wvc_stream.reset(new MemoryStream{
+                static_cast<const uint8_t *>(wvc_data),
+                static_cast<int64_t>(wvc_size), 0});
+        }
+        _error[0] = '\0';
+        _wpc = WavpackOpenFileInputEx64(&memory_reader, _wv_stream.get(),
+                                        _wvc_stream.get(), _error, flags,
+                                        norm_offset);
+        if (_wpc != nullptr) {
+            add_counter(perf_counters.files_opened, 1);
+        }
+        _filename = "<memory>";
+        _flags = flags;
+        _norm_offset = norm_offset;
+    };
+
+    // Same as above, but the Python objects are kept alive by this instance
+    WavpackRead(std::unique_ptr<PythonBuffer> buffer,
+                std::unique_ptr<PythonBuffer> wvc_buffer, int flags,
+                int norm_offset)
+        : WavpackRead(buffer->data(), buffer->size(),
+                      wvc_buffer ? wvc_buffer->data() : nullptr,
+                      wvc_buffer ? wvc_buffer->size() : 0, flags,
+                      norm_offset) {
+        _wv_buffer = std::move(buffer);
+        _wvc_buffer = std::move(wvc_buffer);
     };
 
     auto GetErrorMessage() {
@@ -149,6 +1004,20 @@ struct WavpackRead {
             return _error;
         };
     };
+    auto IsOpen() { return _wpc != nullptr; };
+    // The methods called from Python without the GIL decode while holding
+    // this lock, and CloseFile() from Python takes it too with the GIL, so
+    // that another thread can't free the context in the middle of decoding
+    // or of a getter. Throws if "check_open" and the file is already closed.
+    std::unique_lock<std::mutex> Lock(bool check_open = true) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (check_open && !IsOpen()) {
+            throw std::runtime_error("The file is already closed");
+        }
+        return lock;
+    };
+    auto GetOpenFlags() { return _flags; };
+    auto GetNormOffset() { return _norm_offset; };
     auto GetMode() {
         return WavpackGetMode(static_cast<WavpackContext *>(_wpc));
     };
@@ -194,9 +1063,15 @@ struct WavpackRead {
         return WavpackGetQualifyMode(static_cast<WavpackContext *>(_wpc));
     };
     auto GetNumSamples() {
+        if (_index) {
+            return static_cast<uint32_t>(_index->total_samples);
+        }
         return WavpackGetNumSamples(static_cast<WavpackContext *>(_wpc));
     };
     auto GetNumSamples64() {
+        if (_index) {
+            return _index->total_samples;
+        }
         return WavpackGetNumSamples64(static_cast<WavpackContext *>(_wpc));
     };
     auto GetFileSize() {
@@ -218,6 +1093,26 @@ struct WavpackRead {
     auto GetMd5sum(unsigned char data[16]) {
         return WavpackGetMD5Sum(static_cast<WavpackContext *>(_wpc), data);
     };
+    // The APEv2/ID3v1 tags, which are read only if opened with OPEN_TAGS
+    auto GetNumTagItems() {
+        return WavpackGetNumTagItems(static_cast<WavpackContext *>(_wpc));
+    };
+    auto GetTagItemIndexed(int index) {
+        auto *wpc = static_cast<WavpackContext *>(_wpc);
+        auto size = WavpackGetTagItemIndexed(wpc, index, nullptr, 0);
+        std::string item(size + 1, '\0');
+        WavpackGetTagItemIndexed(wpc, index, &item[0], size + 1);
+        item.resize(size);
+        return item;
+    };
+    auto GetTagItem(const char *item) {
+        auto *wpc = static_cast<WavpackContext *>(_wpc);
+        auto size = WavpackGetTagItem(wpc, item, nullptr, 0);
+        std::string value(size + 1, '\0');
+        WavpackGetTagItem(wpc, item, &value[0], size + 1);
+        value.resize(size);
+        return value;
+    };
     auto GetWrapperBytes() {
         return WavpackGetWrapperBytes(static_cast<WavpackContext *>(_wpc));
     };
@@ -231,21 +1126,80 @@ struct WavpackRead {
         return WavpackSeekTrailingWrapper(static_cast<WavpackContext *>(_wpc));
     };
     auto UnpackSamples(int32_t *buffer, uint32_t samples) {
-        return WavpackUnpackSamples(static_cast<WavpackContext *>(_wpc), buffer,
-                                    samples);
+        auto *wpc = static_cast<WavpackContext *>(_wpc);
+        uint32_t ret;
+        {
+            ScopedTimer timer(perf_counters.unpack_ns);
+            ret = WavpackUnpackSamples(wpc, buffer, samples);
+        }
+        if (ret == 0) {
+            return ret;
+        }
+        add_counter(perf_counters.samples_decoded, ret);
+        auto end = WavpackGetSampleIndex64(wpc);
+        _block_samples = std::max(
+            _block_samples,
+            static_cast<int64_t>(WavpackGetNumSamplesInFrame(wpc)));
+        if (_block_samples > 0) {
+            auto first =
+                std::max((end - ret) / _block_samples, _last_block + 1);
+            auto last = (end - 1) / _block_samples;
+            if (last >= first) {
+                add_counter(perf_counters.blocks_decoded, last - first + 1);
+            }
+            _last_block = std::max(_last_block, last);
+        }
+        auto total = WavpackGetNumSamples64(wpc);
+        if (_library_file && total > 0) {
+            add_counter(perf_counters.bytes_read,
+                  static_cast<int64_t>(
+                      static_cast<double>(WavpackGetFileSize64(wpc)) * ret /
+                      total));
+        }
+        return ret;
     };
     auto SeekSample64(uint64_t sample) {
+        add_counter(perf_counters.seeks, 1);
+        _last_block = -1;
+        if (_index) {
+            return _seek_with_index(static_cast<int64_t>(sample));
+        }
         return WavpackSeekSample64(static_cast<WavpackContext *>(_wpc), sample);
     };
     auto SeekSample(uint32_t sample) {
-        return WavpackSeekSample64(static_cast<WavpackContext *>(_wpc), sample);
+        return SeekSample64(sample);
     };
     auto GetSampleIndex64() {
-        return WavpackGetSampleIndex64(static_cast<WavpackContext *>(_wpc));
+        return _base_sample +
+               WavpackGetSampleIndex64(static_cast<WavpackContext *>(_wpc));
     };
     auto GetSampleIndex() {
-        return WavpackGetSampleIndex(static_cast<WavpackContext *>(_wpc));
+        return static_cast<uint32_t>(GetSampleIndex64());
+    };
+    // Seek with "index" instead of searching the file. The correction file
+    // can't be used together, and the getters of the file size and the
+    // bitrate are relative to the last seek position after seeking.
+    auto SetSeekIndex(std::shared_ptr<WavpackSeekIndex> index) {
+        if (_wpc == nullptr) {
+            throw std::runtime_error("The file is not opened");
+        }
+        if (WavpackGetMode(static_cast<WavpackContext *>(_wpc)) & MODE_WVC) {
+            throw std::invalid_argument(
+                "The seek index can't be used with the correction file");
+        }
+        int64_t size, mtime;
+        if (_wv_stream) {
+            size = _wv_stream->size;
+        } else if (!file_stat(_filename.c_str(), &size, &mtime)) {
+            size = -1;
+        }
+        if (index->file_size != size) {
+            throw std::invalid_argument(
+                "The seek index doesn't match the file");
+        }
+        _index = index;
     };
+    auto GetSeekIndex() { return _index; };
     auto GetInstantBitrate() {
         return WavpackGetInstantBitrate(static_cast<WavpackContext *>(_wpc));
     };
@@ -259,71 +1213,4635 @@ struct WavpackRead {
         return WavpackGetProgress(static_cast<WavpackContext *>(_wpc));
     };
     auto CloseFile() {
-        WavpackCloseFile(static_cast<WavpackContext *>(_wpc));
+        // NOTE(kamo): _wpc is NULL if WavpackOpenFileInput failed, and
+        // __exit__ may close a file which was already closed by the user.
+        if (_wpc != nullptr) {
+            WavpackCloseFile(static_cast<WavpackContext *>(_wpc));
+            _wpc = nullptr;
+        }
+        if (_seek_file) {
+            fclose(_seek_file->file);
+            _seek_file.reset();
+        }
         return;
     };
-};
 
-
-struct WavpackWrite {
-  private:
-  public:
+    // The context must be closed before the memory is released
+    ~WavpackRead() { CloseFile(); };
+    WavpackRead(const WavpackRead &) = delete;
+    WavpackRead &operator=(const WavpackRead &) = delete;
 };
 
 
-auto wavpack_read(const char *infilename, int flags, int norm_offset) {
-    auto wpcc = WavpackRead(infilename, flags, norm_offset);
-    if (wpcc.GetErrorMessage()[0] != '\0'){
-        wpcc.CloseFile();
-        throw std::runtime_error(wpcc.GetErrorMessage());
+// The element type of the arrays returned to Python
+enum class SampleType { Int32, Int16, Float32, Float64 };
+
+static size_t sample_type_size(SampleType type) {
+    switch (type) {
+    case SampleType::Int16:
+        return 2;
+    case SampleType::Float64:
+        return 8;
+    default:
+        return 4;
     }
+};
 
-    auto samples = wpcc.GetNumSamples64();
-    auto channels = wpcc.GetNumChannels();
-    auto bytes_per_sample = wpcc.GetBytesPerSample();
+static nb::dlpack::dtype sample_type_dtype(SampleType type) {
+    switch (type) {
+    case SampleType::Int16:
+        return nb::dtype<int16_t>();
+    case SampleType::Float32:
+        return nb::dtype<float>();
+    case SampleType::Float64:
+        return nb::dtype<double>();
+    default:
+        return nb::dtype<int32_t>();
+    }
+};
 
-    // The audio data is returned right-justified in 32-bit integers in the
-    // endian mode native to the executing processor. So, if the original data
-    // was 16-bit in 2-bytes, then the values returned would be +/-32k. Floating
-    // point data can also be returned if the source was floating point data
-    // (and this can be optionally normalized to +/-1.0 by using the appropriate
-    // flag in the call to WavpackOpenFileInput())
-    auto *data = new int32_t[samples * channels];
+// The name of "type" for numpy.dtype()
+static const char *sample_type_name(SampleType type) {
+    switch (type) {
+    case SampleType::Int16:
+        return "int16";
+    case SampleType::Float32:
+        return "float32";
+    case SampleType::Float64:
+        return "float64";
+    default:
+        return "int32";
+    }
+};
 
-    // "samples" refers to "samples per channel"
-    auto ret = wpcc.UnpackSamples(data, samples);
-    if (ret != samples * channels) {
-        wpcc.CloseFile();
-        throw std::runtime_error(
-            _format("The returned value from UnpackSamples is %d", ret)
-                .c_str());
+// Accept a string such as "float32" or anything numpy.dtype() understands,
+// e.g. numpy.float32. The GIL is needed.
+static SampleType parse_sample_type(nb::handle dtype) {
+    std::string name;
+    if (nb::isinstance<nb::str>(dtype)) {
+        name = nb::cast<std::string>(dtype);
+    } else {
+        name = nb::cast<std::string>(
+            nb::module_::import_("numpy").attr("dtype")(dtype).attr("name"));
     }
+    if (name == "int32") {
+        return SampleType::Int32;
+    } else if (name == "int16") {
+        return SampleType::Int16;
+    } else if (name == "float32") {
+        return SampleType::Float32;
+    } else if (name == "float64") {
+        return SampleType::Float64;
+    }
+    throw std::invalid_argument(
+        _format("dtype must be one of int32, int16, float32 or float64, "
+                "but got %s",
+                name.c_str()));
+};
 
+static SampleType sample_type_of(nb::dlpack::dtype dtype) {
+    for (auto type : {SampleType::Int32, SampleType::Int16,
+                      SampleType::Float32, SampleType::Float64}) {
+        if (sample_type_dtype(type) == dtype) {
+            return type;
+        }
+    }
+    throw std::invalid_argument(
+        "The array must be one of int32, int16, float32 or float64");
+};
+
+
+// How to interpret the int32 values returned by UnpackSamples
+struct SampleFormat {
+    int bytes_per_sample = 4;
+    bool is_float = false;
+    // Multiplied to float data to normalize it to +/-1.0
+    float float_scale = 1.0f;
+};
+
+static SampleFormat get_sample_format(WavpackRead &wpcc) {
+    SampleFormat format;
+    format.bytes_per_sample = wpcc.GetBytesPerSample();
+    format.is_float = (wpcc.GetMode() & MODE_FLOAT) != 0;
+    // Without OPEN_NORMALIZE, the float data is returned as stored, i.e. in
+    // the range of +/-2^(float_norm_exp - 127). With OPEN_NORMALIZE, the
+    // library has already scaled it as the user requested by norm_offset.
+    if (format.is_float && !(wpcc.GetOpenFlags() & OPEN_NORMALIZE)) {
+        format.float_scale =
+            std::ldexp(1.0f, 127 - wpcc.GetFloatNormExp());
+    }
+    return format;
+};
+
+
+// The conversion kernels below are plain loops without any branch in the
+// loop body, so that the compiler can vectorize them.
+
+static void convert_to_int16(const int32_t *src, int16_t *dst, size_t count,
+                             const SampleFormat &format) {
+    if (format.is_float) {
+        // The samples are shifted to [0, 65535] and clamped there, so that
+        // truncating rounds to nearest (halves away from -inf) and every
+        // input has a defined result. std::max() keeps its first argument
+        // for NaN, which therefore becomes -32768. Unlike std::lrint(), this
+        // has no call that keeps the loop from being vectorized.
+        auto scale = format.float_scale * 32768.0f;
+        for (size_t i = 0; i < count; i++) {
+            float value;
+            std::memcpy(&value, &src[i], sizeof(float));
+            value = std::min(std::max(0.0f, value * scale + 32768.5f), 65535.0f);
+            dst[i] = static_cast<int16_t>(static_cast<int32_t>(value) - 32768);
+        }
+        return;
+    }
+    // Right-justified integers are narrowed by dropping the LSBs
+    auto shift = format.bytes_per_sample * 8 - 16;
+    if (shift > 0) {
+        for (size_t i = 0; i < count; i++) {
+            dst[i] = static_cast<int16_t>(src[i] >> shift);
+        }
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            dst[i] = static_cast<int16_t>(src[i] * (1 << -shift));
+        }
+    }
+};
+
+template <typename T>
+static void convert_to_float(const int32_t *src, T *dst, size_t count,
+                             const SampleFormat &format) {
+    if (format.is_float) {
+        auto scale = static_cast<T>(format.float_scale);
+        for (size_t i = 0; i < count; i++) {
+            float value;
+            std::memcpy(&value, &src[i], sizeof(float));
+            dst[i] = static_cast<T>(value) * scale;
+        }
+        return;
+    }
+    // Integers are normalized to [-1.0, 1.0)
+    auto scale = static_cast<T>(
+        std::ldexp(1.0, -(format.bytes_per_sample * 8 - 1)));
+    for (size_t i = 0; i < count; i++) {
+        dst[i] = static_cast<T>(src[i]) * scale;
+    }
+};
+
+// Convert "count" values unpacked by UnpackSamples into "dst", which is an
+// array of "type". int32 is copied as is, i.e. float data is left as the bit
+// patterns for backward compatibility.
+static void convert_samples(const int32_t *src, void *dst, size_t count,
+                            const SampleFormat &format, SampleType type) {
+    ScopedTimer timer(perf_counters.convert_ns);
+    switch (type) {
+    case SampleType::Int32:
+        std::memcpy(dst, src, count * sizeof(int32_t));
+        break;
+    case SampleType::Int16:
+        convert_to_int16(src, static_cast<int16_t *>(dst), count, format);
+        break;
+    case SampleType::Float32:
+        convert_to_float(src, static_cast<float *>(dst), count, format);
+        break;
+    case SampleType::Float64:
+        convert_to_float(src, static_cast<double *>(dst), count, format);
+        break;
+    }
+};
+
+
+// UnpackSamples takes the number of samples as uint32_t, so very long
+// windows are decoded in several calls.
+static const int64_t max_unpack = 1 << 20;
+
+// The number of samples per channel converted at once. Small enough that the
+// int32 scratch buffer stays in the L2 cache between unpacking and converting.
+static const int64_t convert_block = 4096;
+
+// Unpack up to "frames" samples per channel from the current position into
+// "dst", which is an array of "type". Returns the number of samples per
+// channel actually unpacked, which is smaller at the end of the file.
+static int64_t unpack_converted(WavpackRead &wpcc, const SampleFormat &format,
+                                int channels, SampleType type, void *dst,
+                                int64_t frames,
+                                std::vector<int32_t> &scratch) {
+    int64_t done = 0;
+    if (type == SampleType::Int32) {
+        // No conversion is needed, so unpack into "dst" directly
+        auto *out = static_cast<int32_t *>(dst);
+        while (done < frames) {
+            auto n = std::min(frames - done, max_unpack);
+            auto ret = wpcc.UnpackSamples(out + done * channels,
+                                          static_cast<uint32_t>(n));
+            done += ret;
+            if (ret == 0) {
+                break;
+            }
+        }
+        return done;
+    }
+
+    auto item_size = sample_type_size(type);
+    auto *out = static_cast<uint8_t *>(dst);
+    scratch.resize(convert_block * channels);
+    while (done < frames) {
+        auto n = std::min(frames - done, convert_block);
+        auto ret =
+            wpcc.UnpackSamples(scratch.data(), static_cast<uint32_t>(n));
+        if (ret == 0) {
+            break;
+        }
+        convert_samples(scratch.data(), out + done * channels * item_size,
+                        static_cast<size_t>(ret) * channels, format, type);
+        done += ret;
+    }
+    return done;
+};
+
+
+// A pool of 64-byte aligned buffers for the decoded arrays. Decoding many
+// small clips in a row allocates and frees the same sizes over and over,
+// which shows up as page faults when every buffer is fresh memory. Buffers
+// are rounded up to size classes (4 per power of two) and the released ones
+// are kept per class up to "max_bytes". The pool is disabled by default, in
+// which case released buffers are freed immediately.
+struct BufferPool {
+    std::mutex mutex;
+    // Read without the mutex, so that allocations skip it while disabled
+    std::atomic<bool> enabled{false};
+    // Align the allocations of 2MB or more to 2MB and advise transparent
+    // hugepages. The data starts after the 64-byte header, i.e. it's backed
+    // by hugepages but isn't 2MB aligned itself.
+    std::atomic<bool> hugepages{false};
+    size_t max_bytes = 256 << 20;
+    std::map<size_t, std::vector<void *>> free_lists;
+    size_t cached_bytes = 0;
+    size_t cached_buffers = 0;
+    size_t in_use_bytes = 0;
+    size_t in_use_buffers = 0;
+    int64_t hits = 0;
+    int64_t misses = 0;
+    // in_use_* only count the buffers allocated while the pool is enabled
+};
+
+// Never destroyed, because arrays may return buffers during the shutdown
+static BufferPool &buffer_pool = *new BufferPool();
+
+// Every buffer is preceded by a header of this size storing its size class,
+// which also keeps the data 64-byte aligned. The size class is 0 for the
+// buffers allocated while the pool is disabled, which have the exact size
+// and are never cached.
+static const size_t pool_alignment = 64;
+static const size_t hugepage_size = 2 << 20;
+
+static size_t pool_size_class(size_t size) {
+    size_t power = 4096;
+    while (power < size) {
+        power <<= 1;
+    }
+    if (size <= power / 2) {
+        return power;
+    }
+    // (power / 2, power] is divided into 4 classes
+    auto step = power / 8;
+    return (size + step - 1) / step * step;
+};
+
+static void *pool_allocate_raw(size_t bytes, bool hugepages) {
+    auto alignment = pool_alignment;
+    if (hugepages && bytes >= hugepage_size) {
+        alignment = hugepage_size;
+    }
+    void *p;
+#if defined(_WIN32)
+    p = _aligned_malloc(bytes, alignment);
+#else
+    if (posix_memalign(&p, alignment, bytes) != 0) {
+        p = nullptr;
+    }
+#ifdef MADV_HUGEPAGE
+    if (p != nullptr && alignment == hugepage_size) {
+        madvise(p, bytes, MADV_HUGEPAGE);
+    }
+#endif
+#endif
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+};
+
+static void pool_free_raw(void *p) {
+#if defined(_WIN32)
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+};
+
+// Return a buffer taken by pool_allocate(). This doesn't need the GIL.
+static void pool_release(void *data) {
+    if (data == nullptr) {
+        return;
+    }
+    auto *base = static_cast<uint8_t *>(data) - pool_alignment;
+    size_t size_class;
+    std::memcpy(&size_class, base, sizeof(size_class));
+    if (size_class == 0) {
+        pool_free_raw(base);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(buffer_pool.mutex);
+        buffer_pool.in_use_bytes -= size_class;
+        buffer_pool.in_use_buffers--;
+        if (buffer_pool.enabled &&
+            buffer_pool.cached_bytes + size_class <= buffer_pool.max_bytes) {
+            buffer_pool.free_lists[size_class].push_back(base);
+            buffer_pool.cached_bytes += size_class;
+            buffer_pool.cached_buffers++;
+            return;
+        }
+    }
+    pool_free_raw(base);
+};
+
+struct PoolDeleter {
+    void operator()(uint8_t *p) const noexcept { pool_release(p); };
+};
+using PooledData = std::unique_ptr<uint8_t[], PoolDeleter>;
+
+// Take a buffer of at least "size" bytes. This doesn't need the GIL.
+static PooledData pool_allocate(size_t size) {
+    ScopedTimer timer(perf_counters.alloc_ns);
+    if (!buffer_pool.enabled.load(std::memory_order_relaxed)) {
+        size_t unpooled = 0;
+        auto *base = pool_allocate_raw(
+            size + pool_alignment,
+            buffer_pool.hugepages.load(std::memory_order_relaxed));
+        std::memcpy(base, &unpooled, sizeof(unpooled));
+        return PooledData(static_cast<uint8_t *>(base) + pool_alignment);
+    }
+    auto size_class = pool_size_class(size);
+    void *base = nullptr;
+    auto hugepages = buffer_pool.hugepages.load();
+    {
+        std::lock_guard<std::mutex> lock(buffer_pool.mutex);
+        if (buffer_pool.enabled) {
+            auto it = buffer_pool.free_lists.find(size_class);
+            if (it != buffer_pool.free_lists.end() && !it->second.empty()) {
+                base = it->second.back();
+                it->second.pop_back();
+                buffer_pool.cached_bytes -= size_class;
+                buffer_pool.cached_buffers--;
+                buffer_pool.hits++;
+            } else {
+                buffer_pool.misses++;
+            }
+        }
+    }
+    if (base == nullptr) {
+        base = pool_allocate_raw(size_class + pool_alignment, hugepages);
+        std::memcpy(base, &size_class, sizeof(size_class));
+    }
+    {
+        std::lock_guard<std::mutex> lock(buffer_pool.mutex);
+        buffer_pool.in_use_bytes += size_class;
+        buffer_pool.in_use_buffers++;
+    }
+    return PooledData(static_cast<uint8_t *>(base) + pool_alignment);
+};
+
+// Free the cached buffers, from the largest ones, until at most "keep_bytes"
+// are left. Returns the number of bytes freed.
+static size_t pool_trim(size_t keep_bytes) {
+    std::vector<void *> buffers;
+    size_t freed = 0;
+    {
+        std::lock_guard<std::mutex> lock(buffer_pool.mutex);
+        auto &lists = buffer_pool.free_lists;
+        for (auto it = lists.rbegin(); it != lists.rend(); ++it) {
+            while (!it->second.empty() &&
+                   buffer_pool.cached_bytes > keep_bytes) {
+                buffers.push_back(it->second.back());
+                it->second.pop_back();
+                buffer_pool.cached_bytes -= it->first;
+                buffer_pool.cached_buffers--;
+                freed += it->first;
+            }
+        }
+    }
+    for (auto *p : buffers) {
+        pool_free_raw(p);
+    }
+    return freed;
+};
+
+// Hand over "data" to a capsule which returns it to the pool when the array
+// expires. The GIL is needed.
+static nb::capsule pooled_owner(PooledData &data) {
+    return nb::capsule(data.release(),
+                       [](void *p) noexcept { pool_release(p); });
+};
+
+
+// Which channels to decode and how to lay them out. An empty "channels"
+// means all the channels in the original order. Planar output has the shape
+// of (channels, frames) instead of (frames, channels).
+struct ChannelLayout {
+    std::vector<int> channels;
+    bool planar = false;
+
+    bool is_default() const { return channels.empty() && !planar; };
+};
+
+// The source channels of the output channels, with negative indices
+// counted from the last channel as Python does
+static std::vector<int> resolve_channels(const ChannelLayout &layout,
+                                         int num_channels) {
+    std::vector<int> selected;
+    if (layout.channels.empty()) {
+        for (int c = 0; c < num_channels; c++) {
+            selected.push_back(c);
+        }
+        return selected;
+    }
+    for (auto c : layout.channels) {
+        auto index = c < 0 ? c + num_channels : c;
+        if (index < 0 || index >= num_channels) {
+            throw std::invalid_argument(
+                _format("The channel %d is out of range for %d channels", c,
+                        num_channels));
+        }
+        selected.push_back(index);
+    }
+    return selected;
+};
+
+// Convert "frames" interleaved samples of all the channels in "src" into the
+// "selected" channels of "dst" from the frame "offset". Planar "dst" has
+// "stride" frames per channel. The samples are gathered in blocks of
+// convert_block frames, so that "src" stays in the cache while it's read
+// channel by channel.
+static void select_converted(const int32_t *src, int64_t frames, int channels,
+                             const std::vector<int> &selected, bool planar,
+                             const SampleFormat &format, SampleType type,
+                             uint8_t *dst, int64_t offset, int64_t stride,
+                             std::vector<int32_t> &gathered) {
+    auto item_size = sample_type_size(type);
+    auto count = static_cast<int64_t>(selected.size());
+    for (int64_t begin = 0; begin < frames; begin += convert_block) {
+        auto n = std::min(frames - begin, convert_block);
+        auto *block = src + begin * channels;
+        if (planar) {
+            gathered.resize(n);
+            for (int64_t c = 0; c < count; c++) {
+                auto from = selected[c];
+                for (int64_t f = 0; f < n; f++) {
+                    gathered[f] = block[f * channels + from];
+                }
+                convert_samples(gathered.data(),
+                                dst + (c * stride + offset + begin) * item_size,
+                                n, format, type);
+            }
+        } else {
+            gathered.resize(n * count);
+            for (int64_t f = 0; f < n; f++) {
+                for (int64_t c = 0; c < count; c++) {
+                    gathered[f * count + c] = block[f * channels + selected[c]];
+                }
+            }
+            convert_samples(gathered.data(),
+                            dst + (offset + begin) * count * item_size,
+                            n * count, format, type);
+        }
+    }
+};
+
+// The same as unpack_converted(), but only the "selected" channels are
+// written into "dst" from the frame "offset" as select_converted() does
+static int64_t unpack_selected(WavpackRead &wpcc, const SampleFormat &format,
+                               int channels, const std::vector<int> &selected,
+                               bool planar, SampleType type, uint8_t *dst,
+                               int64_t offset, int64_t frames, int64_t stride,
+                               std::vector<int32_t> &scratch) {
+    std::vector<int32_t> gathered;
+    scratch.resize(convert_block * channels);
+    int64_t done = 0;
+    while (done < frames) {
+        auto n = std::min(frames - done, convert_block);
+        auto ret =
+            wpcc.UnpackSamples(scratch.data(), static_cast<uint32_t>(n));
+        if (ret == 0) {
+            break;
+        }
+        select_converted(scratch.data(), ret, channels, selected, planar,
+                         format, type, dst, offset + done, stride, gathered);
+        done += ret;
+    }
+    return done;
+};
+
+
+// Audio decoded by decode_window(), interleaved as (frames, channels) or
+// planar as (channels, frames)
+struct DecodedAudio {
+    PooledData data;
+    SampleType type = SampleType::Int32;
+    int64_t frames = 0;
+    int channels = 0;
+    bool planar = false;
+    uint32_t sample_rate = 0;
+};
+
+
+// Decode "frames" samples per channel starting from "start" into an array of
+// "type".
+//
+// The window is clipped to the end of the file like Python slicing, i.e. a
+// request running past the end returns only the available samples and a
+// request starting at or after the end returns zero frames. frames < 0 means
+// "until the end of the file".
+static DecodedAudio decode_window(WavpackRead &wpcc, int64_t start,
+                                  int64_t frames,
+                                  SampleType type = SampleType::Int32,
+                                  const ChannelLayout &layout = ChannelLayout()) {
+    if (start < 0) {
+        throw std::invalid_argument(
+            _format("start must be non-negative, but got %lld",
+                    static_cast<long long>(start)));
+    }
+
+    DecodedAudio audio;
+    audio.type = type;
+    auto num_channels = wpcc.GetNumChannels();
+    auto selected = resolve_channels(layout, num_channels);
+    audio.channels = static_cast<int>(selected.size());
+    audio.planar = layout.planar;
+    auto format = get_sample_format(wpcc);
+    auto item_size = sample_type_size(type);
+
+    // GetNumSamples64() returns -1 if the length is unknown, e.g. the file
+    // was created from a pipe. In this case, the window is only bounded by
+    // the point where UnpackSamples stops returning samples.
+    auto total = wpcc.GetNumSamples64();
+    if (total >= 0) {
+        if (start >= total) {
+            frames = 0;
+        } else if (frames < 0 || frames > total - start) {
+            frames = total - start;
+        }
+    }
+    if (frames == 0) {
+        audio.data = pool_allocate(0);
+        return audio;
+    }
+
+    if (start > 0 && !wpcc.SeekSample64(start)) {
+        // With an unknown length, the end can't be checked in advance, and
+        // the seek fails for a start after the end. The window is empty as
+        // it is for a known length.
+        if (total < 0) {
+            audio.data = pool_allocate(0);
+            return audio;
+        }
+        throw std::runtime_error(
+            _format("Failed to seek to the sample %lld",
+                    static_cast<long long>(start)));
+    }
+
+    std::vector<int32_t> scratch;
+    if (frames > 0) {
+        audio.data = pool_allocate(frames * audio.channels * item_size);
+        if (layout.is_default()) {
+            audio.frames = unpack_converted(wpcc, format, audio.channels,
+                                            type, audio.data.get(), frames,
+                                            scratch);
+        } else {
+            audio.frames = unpack_selected(
+                wpcc, format, num_channels, selected, layout.planar, type,
+                audio.data.get(), 0, frames, frames, scratch);
+        }
+        if (total >= 0 && audio.frames != frames) {
+            throw std::runtime_error(
+                _format("UnpackSamples returned %lld samples, but %lld "
+                        "samples were expected",
+                        static_cast<long long>(audio.frames),
+                        static_cast<long long>(frames)));
+        }
+        // With an unknown length the stream may end early, and then the
+        // planar rows written at the stride "frames" are packed to the
+        // stride audio.frames
+        if (layout.planar && audio.frames < frames) {
+            auto *data = audio.data.get();
+            for (int c = 1; c < audio.channels; c++) {
+                std::memmove(data + c * audio.frames * item_size,
+                             data + c * frames * item_size,
+                             audio.frames * item_size);
+            }
+        }
+        return audio;
+    }
+
+    // Unknown length and open-ended window: grow until the end of the stream
+    std::vector<int32_t> buffer;
+    while (true) {
+        buffer.resize((audio.frames + max_unpack) * num_channels);
+        auto ret = wpcc.UnpackSamples(
+            buffer.data() + audio.frames * num_channels,
+            static_cast<uint32_t>(max_unpack));
+        audio.frames += ret;
+        if (ret == 0) {
+            break;
+        }
+    }
+    audio.data = pool_allocate(audio.frames * audio.channels * item_size);
+    if (layout.is_default()) {
+        convert_samples(buffer.data(), audio.data.get(),
+                        audio.frames * audio.channels, format, type);
+    } else {
+        select_converted(buffer.data(), audio.frames, num_channels, selected,
+                         layout.planar, format, type, audio.data.get(), 0,
+                         audio.frames, scratch);
+    }
+    return audio;
+};
+
+
+// Run fn(i) for i in [0, n) on a pool of native worker threads.
+//
+// num_threads <= 0 means "as many threads as the hardware supports". fn must
+// not touch Python objects because it is called without the GIL. The first
+// exception thrown by fn is re-thrown in the calling thread after all the
+// workers have finished, and the remaining items are not started.
+template <typename Fn>
+static void parallel_for(size_t n, int num_threads, Fn &&fn) {
+    if (num_threads <= 0) {
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    num_threads = static_cast<int>(
+        std::min(static_cast<size_t>(num_threads), n));
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    auto worker = [&]() {
+        while (!failed.load()) {
+            auto i = next.fetch_add(1);
+            if (i >= n) {
+                break;
+            }
+            try {
+                fn(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                failed.store(true);
+            }
+        }
+    };
+
+    if (num_threads <= 1) {
+        worker();
+    } else {
+        std::vector<std::thread> threads;
+        threads.reserve(num_threads);
+        for (int i = 0; i < num_threads; i++) {
+            threads.emplace_back(worker);
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+};
+
+
+// Add the number of worker threads of the library to "flags" for
+// WavpackOpenFileInput. The library uses up to 15 additional threads to
+// decode the channels of multichannel files in parallel.
+static int with_worker_threads(int flags, int worker_threads) {
+#ifdef OPEN_THREADS_SHFT
+    if (worker_threads > 0) {
+        flags = (flags & ~OPEN_THREADS_MASK) |
+                (std::min(worker_threads, 15) << OPEN_THREADS_SHFT);
+    }
+#endif
+    return flags;
+};
+
+
+// Decode a window of an opened file and close it. This doesn't touch any
+// Python object, so it can be called without the GIL.
+static DecodedAudio read_opened(WavpackRead &wpcc, int64_t start,
+                                int64_t frames, SampleType type,
+                                const ChannelLayout &layout = ChannelLayout()) {
+    if (wpcc.GetErrorMessage()[0] != '\0'){
+        wpcc.CloseFile();
+        throw std::runtime_error(wpcc.GetErrorMessage());
+    }
+
+    // The audio data is returned right-justified in 32-bit integers in the
+    // endian mode native to the executing processor. So, if the original data
+    // was 16-bit in 2-bytes, then the values returned would be +/-32k. Floating
+    // point data can also be returned if the source was floating point data
+    // (and this can be optionally normalized to +/-1.0 by using the appropriate
+    // flag in the call to WavpackOpenFileInput())
+    DecodedAudio audio;
+    try {
+        // Only the requested window is allocated and decoded
+        audio = decode_window(wpcc, start, frames, type, layout);
+    } catch (...) {
+        wpcc.CloseFile();
+        throw;
+    }
+    audio.sample_rate = wpcc.GetNativeSampleRate();
+    wpcc.CloseFile();
+    return audio;
+};
+
+
+static void check_readable(WavpackRead &wpcc) {
+    if (wpcc.GetErrorMessage()[0] != '\0') {
+        throw std::runtime_error(wpcc.GetErrorMessage());
+    }
+    if (!wpcc.IsOpen()) {
+        throw std::runtime_error("The file is already closed");
+    }
+};
+
+
+// A read-only memory mapping of a whole file
+struct MappedFile {
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+#if defined(_WIN32)
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+
+    explicit MappedFile(const char *filename) {
+#if defined(_WIN32)
+        // The file name is UTF-8 as the other functions of this module
+        auto length = MultiByteToWideChar(CP_UTF8, 0, filename, -1, nullptr, 0);
+        std::vector<wchar_t> wide(length > 0 ? length : 1, L'\0');
+        MultiByteToWideChar(CP_UTF8, 0, filename, -1, wide.data(), length);
+        file = CreateFileW(wide.data(), GENERIC_READ, FILE_SHARE_READ,
+                           nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                           nullptr);
+        LARGE_INTEGER file_size;
+        if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &file_size)) {
+            _close();
+            throw std::runtime_error(_format("Failed to open %s", filename));
+        }
+        size = static_cast<size_t>(file_size.QuadPart);
+        if (size > 0) {
+            mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0,
+                                         nullptr);
+            if (mapping != nullptr) {
+                data = static_cast<const uint8_t *>(
+                    MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+            }
+        }
+#else
+        auto fd = open(filename, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            throw std::runtime_error(_format("Failed to open %s", filename));
+        }
+        size = static_cast<size_t>(st.st_size);
+        if (size > 0) {
+            auto *p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            if (p != MAP_FAILED) {
+                data = static_cast<const uint8_t *>(p);
+            }
+        }
+        // The mapping stays valid after closing the descriptor
+        close(fd);
+#endif
+        if (data == nullptr) {
+            _close();
+            throw std::runtime_error(_format("Failed to map %s", filename));
+        }
+    };
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    void _close() {
+#if defined(_WIN32)
+        if (data != nullptr) {
+            UnmapViewOfFile(data);
+        }
+        if (mapping != nullptr) {
+            CloseHandle(mapping);
+        }
+        if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+        }
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (data != nullptr) {
+            munmap(const_cast<uint8_t *>(data), size);
+        }
+#endif
+        data = nullptr;
+    };
+    ~MappedFile() { _close(); };
+};
+
+
+// Frames per segment below which splitting a read doesn't pay off, i.e.
+// the cost of the threads and of indexing the file isn't paid back
+static const int64_t min_segment_frames = 1 << 18;
+
+// Decode [start, start + frames) of a file on up to "num_threads" threads,
+// clipped in the same way as decode_window(). The range is split at the
+// block boundaries found in the seek index and each segment is decoded by
+// its own context into its part of the output. Every block is decoded
+// independently of the others, so the result is identical to decoding the
+// whole range with one context. The file is mapped, so that indexing it
+// (unless the index is cached) and opening the contexts in the streaming
+// mode at the blocks need no system call per block or per segment.
+//
+// "wpcc" is an opened context of the file, which is used as it is if the
+// read can't be split, e.g. with a correction file or an unknown length.
+static DecodedAudio decode_parallel(WavpackRead &wpcc, const char *infilename,
+                                    int64_t start, int64_t frames,
+                                    SampleType type, int num_threads,
+                                    const ChannelLayout &layout) {
+    auto total = wpcc.GetNumSamples64();
+    if (start < 0 || total < 0 || (wpcc.GetMode() & MODE_WVC)) {
+        return decode_window(wpcc, start, frames, type, layout);
+    }
+    if (start >= total) {
+        frames = 0;
+    } else if (frames < 0 || frames > total - start) {
+        frames = total - start;
+    }
+    if (num_threads <= 0) {
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    auto count = std::min(static_cast<int64_t>(num_threads),
+                          frames / min_segment_frames);
+    if (count <= 1) {
+        return decode_window(wpcc, start, frames, type, layout);
+    }
+    MappedFile file(infilename);
+    auto index = get_seek_index(infilename, "", file.data, file.size);
+    if (index->total_samples != total ||
+        static_cast<size_t>(index->file_size) != file.size) {
+        return decode_window(wpcc, start, frames, type, layout);
+    }
+
+    // Snap the boundaries of equal segments to the beginning of the blocks
+    std::vector<int64_t> bounds = {start};
+    for (int64_t k = 1; k < count; k++) {
+        auto i = index->find(start + frames * k / count);
+        if (i >= 0 && index->entries[i].block_index > bounds.back()) {
+            bounds.push_back(index->entries[i].block_index);
+        }
+    }
+    bounds.push_back(start + frames);
+
+    DecodedAudio audio;
+    audio.type = type;
+    auto num_channels = wpcc.GetNumChannels();
+    auto selected = resolve_channels(layout, num_channels);
+    audio.channels = static_cast<int>(selected.size());
+    audio.planar = layout.planar;
+    audio.frames = frames;
+    auto format = get_sample_format(wpcc);
+    auto frame_size = audio.channels * sample_type_size(type);
+    audio.data = pool_allocate(frames * frame_size);
+    auto flags = wpcc.GetOpenFlags();
+    auto norm_offset = wpcc.GetNormOffset();
+
+    parallel_for(bounds.size() - 1, num_threads, [&](size_t k) {
+        auto i = index->find(bounds[k]);
+        if (i < 0) {
+            throw std::runtime_error("The seek index is broken");
+        }
+        auto &entry = index->entries[i];
+        auto segment = WavpackRead(
+            file.data + entry.offset, file.size - entry.offset, nullptr, 0,
+            (flags | OPEN_STREAMING) & ~(OPEN_WVC | OPEN_TAGS), norm_offset);
+        check_readable(segment);
+        std::vector<int32_t> scratch;
+        // Only the first segment may start in the middle of a block
+        for (auto skip = bounds[k] - entry.block_index; skip > 0;) {
+            scratch.resize(convert_block * num_channels);
+            auto ret = segment.UnpackSamples(
+                scratch.data(),
+                static_cast<uint32_t>(std::min(skip, convert_block)));
+            if (ret == 0) {
+                throw std::runtime_error(
+                    _format("Failed to seek to the sample %lld",
+                            static_cast<long long>(bounds[k])));
+            }
+            skip -= ret;
+        }
+        auto n = bounds[k + 1] - bounds[k];
+        int64_t done;
+        if (layout.is_default()) {
+            done = unpack_converted(
+                segment, format, audio.channels, type,
+                audio.data.get() + (bounds[k] - start) * frame_size, n,
+                scratch);
+        } else {
+            done = unpack_selected(segment, format, num_channels, selected,
+                                   layout.planar, type, audio.data.get(),
+                                   bounds[k] - start, n, frames, scratch);
+        }
+        if (done != n) {
+            throw std::runtime_error(
+                _format("UnpackSamples returned %lld samples, but %lld "
+                        "samples were expected",
+                        static_cast<long long>(done),
+                        static_cast<long long>(n)));
+        }
+    });
+    return audio;
+};
+
+
+static DecodedAudio read_file(const char *infilename, int flags,
+                              int norm_offset, int64_t start, int64_t frames,
+                              SampleType type, bool use_index = false,
+                              int num_threads = 1,
+                              const ChannelLayout &layout = ChannelLayout()) {
+    auto wpcc = WavpackRead(infilename, flags, norm_offset);
+    if (num_threads != 1 && wpcc.GetErrorMessage()[0] == '\0') {
+        DecodedAudio audio;
+        try {
+            audio = decode_parallel(wpcc, infilename, start, frames, type,
+                                    num_threads, layout);
+        } catch (...) {
+            wpcc.CloseFile();
+            throw;
+        }
+        audio.sample_rate = wpcc.GetNativeSampleRate();
+        wpcc.CloseFile();
+        return audio;
+    }
+    if (use_index && start > 0 && wpcc.IsOpen() &&
+        !(wpcc.GetMode() & MODE_WVC)) {
+        wpcc.SetSeekIndex(get_seek_index(infilename, ""));
+    }
+    return read_opened(wpcc, start, frames, type, layout);
+};
+
+
+// Hand over the decoded samples to numpy without copying. The GIL is needed.
+static auto to_ndarray(DecodedAudio &audio) {
     size_t shape[2] = {
-        static_cast<size_t>(samples),
-        static_cast<size_t>(channels),
+        static_cast<size_t>(audio.frames),
+        static_cast<size_t>(audio.channels),
+    };
+    if (audio.planar) {
+        std::swap(shape[0], shape[1]);
+    }
+
+    // Return 'data' to the pool when the 'owner' capsule expires
+    auto *data = audio.data.get();
+    auto owner = pooled_owner(audio.data);
+
+    auto array = nb::ndarray<nb::numpy>(data, /* ndim = */ 2, shape, owner,
+                                        /* strides = */ nullptr,
+                                        sample_type_dtype(audio.type));
+    return std::tuple(array, audio.sample_rate);
+};
+
+
+// channels is None, an int or a sequence of ints, and layout is
+// "interleaved" or "planar"
+static ChannelLayout parse_channel_layout(nb::handle channels,
+                                          const std::string &layout) {
+    ChannelLayout result;
+    if (layout == "planar") {
+        result.planar = true;
+    } else if (layout != "interleaved") {
+        throw std::invalid_argument(
+            _format("layout must be \"interleaved\" or \"planar\", but "
+                    "got \"%s\"",
+                    layout.c_str()));
+    }
+    if (channels.is_none()) {
+        return result;
+    }
+    if (nb::isinstance<nb::int_>(channels)) {
+        result.channels.push_back(nb::cast<int>(channels));
+    } else {
+        result.channels = nb::cast<std::vector<int>>(channels);
+        if (result.channels.empty()) {
+            throw std::invalid_argument("channels must not be empty");
+        }
+    }
+    return result;
+};
+
+
+auto wavpack_read(const char *infilename, int flags, int norm_offset,
+                  int64_t start, int64_t frames, nb::handle dtype,
+                  int worker_threads, bool use_index, int num_threads,
+                  nb::handle channels, const std::string &layout) {
+    auto type = parse_sample_type(dtype);
+    auto channel_layout = parse_channel_layout(channels, layout);
+    flags = with_worker_threads(flags, worker_threads);
+    DecodedAudio audio;
+    {
+        nb::gil_scoped_release release;
+        audio = read_file(infilename, flags, norm_offset, start, frames, type,
+                          use_index, num_threads, channel_layout);
+    }
+    return to_ndarray(audio);
+};
+
+
+auto wavpack_read_bytes(nb::handle data, nb::handle wvc_data, int flags,
+                        int norm_offset, int64_t start, int64_t frames,
+                        nb::handle dtype, int worker_threads,
+                        nb::handle channels, const std::string &layout) {
+    auto type = parse_sample_type(dtype);
+    auto channel_layout = parse_channel_layout(channels, layout);
+    flags = with_worker_threads(flags, worker_threads);
+    // The buffers are released after the GIL is reacquired
+    PythonBuffer buffer(data);
+    std::unique_ptr<PythonBuffer> wvc_buffer;
+    if (!wvc_data.is_none()) {
+        wvc_buffer.reset(new PythonBuffer(wvc_data));
+    }
+
+    DecodedAudio audio;
+    {
+        nb::gil_scoped_release release;
+        auto wpcc = WavpackRead(
+            buffer.data(), buffer.size(),
+            wvc_buffer ? wvc_buffer->data() : nullptr,
+            wvc_buffer ? wvc_buffer->size() : 0, flags, norm_offset);
+        audio = read_opened(wpcc, start, frames, type, channel_layout);
+    }
+    return to_ndarray(audio);
+};
+
+
+auto wavpack_read_many(const std::vector<std::string> &infilenames, int flags,
+                       int norm_offset, int num_threads, nb::handle dtype,
+                       int worker_threads, nb::handle channels,
+                       const std::string &layout) {
+    auto type = parse_sample_type(dtype);
+    auto channel_layout = parse_channel_layout(channels, layout);
+    flags = with_worker_threads(flags, worker_threads);
+    std::vector<DecodedAudio> audios(infilenames.size());
+    {
+        nb::gil_scoped_release release;
+        parallel_for(infilenames.size(), num_threads, [&](size_t i) {
+            try {
+                audios[i] = read_file(infilenames[i].c_str(), flags,
+                                      norm_offset, 0, -1, type, false, 1,
+                                      channel_layout);
+            } catch (const std::exception &e) {
+                throw std::runtime_error(
+                    _format("%s: %s", infilenames[i].c_str(), e.what()));
+            }
+        });
+    }
+
+    nb::list results;
+    for (auto &audio : audios) {
+        results.append(to_ndarray(audio));
+    }
+    return results;
+};
+
+
+// A writable C-contiguous array on CPU given by the user to be filled
+using OutputArray = nb::ndarray<nb::c_contig, nb::device::cpu>;
+
+// Check that "out" can hold samples of "wpcc" as (frames, channels)
+static void check_output_array(WavpackRead &wpcc, const OutputArray &out) {
+    if (out.ndim() != 2 ||
+        out.shape(1) != static_cast<size_t>(wpcc.GetNumChannels())) {
+        throw std::invalid_argument(
+            _format("The array must be 2-dimensional with the shape of "
+                    "(frames, %d)",
+                    wpcc.GetNumChannels()));
+    }
+};
+
+
+// Decode from the current position into "out" and return the number of
+// frames filled, which is smaller than out.shape[0] at the end of the file.
+auto wavpack_readinto(WavpackRead &self, OutputArray out) {
+    check_readable(self);
+    check_output_array(self, out);
+    auto type = sample_type_of(out.dtype());
+    auto format = get_sample_format(self);
+    auto channels = self.GetNumChannels();
+
+    nb::gil_scoped_release release;
+    auto lock = self.Lock();
+    std::vector<int32_t> scratch;
+    return unpack_converted(self, format, channels, type, out.data(),
+                            static_cast<int64_t>(out.shape(0)), scratch);
+};
+
+
+// Yield fixed-size chunks from the current position of a WavpackRead. If an
+// output array is given, every chunk is written into it and the array (or a
+// view of its head for the last, shorter chunk) is yielded, so that no memory
+// is allocated after the first iteration.
+struct WavpackBlockIterator {
+    WavpackRead *reader;
+    int64_t frames_per_block;
+    SampleType type;
+    SampleFormat format;
+    int channels;
+    nb::object out_obj;
+    OutputArray out;
+    std::vector<int32_t> scratch;
+
+    nb::object next() {
+        check_readable(*reader);
+
+        if (!out_obj.is_valid()) {
+            DecodedAudio audio;
+            audio.type = type;
+            audio.channels = channels;
+            audio.data = pool_allocate(frames_per_block * channels *
+                                       sample_type_size(type));
+            {
+                nb::gil_scoped_release release;
+                auto lock = reader->Lock();
+                audio.frames =
+                    unpack_converted(*reader, format, channels, type,
+                                     audio.data.get(), frames_per_block,
+                                     scratch);
+            }
+            if (audio.frames == 0) {
+                throw nb::stop_iteration();
+            }
+            return nb::cast(std::get<0>(to_ndarray(audio)));
+        }
+
+        int64_t n;
+        {
+            nb::gil_scoped_release release;
+            auto lock = reader->Lock();
+            n = unpack_converted(*reader, format, channels, type, out.data(),
+                                 frames_per_block, scratch);
+        }
+        if (n == 0) {
+            throw nb::stop_iteration();
+        }
+        if (n == frames_per_block &&
+            out.shape(0) == static_cast<size_t>(frames_per_block)) {
+            return out_obj;
+        }
+        size_t shape[2] = {static_cast<size_t>(n),
+                           static_cast<size_t>(channels)};
+        return nb::cast(nb::ndarray<nb::numpy>(out.data(), 2, shape, out_obj,
+                                               nullptr, out.dtype()));
+    };
+};
+
+
+auto wavpack_iter_blocks(WavpackRead &self, int64_t frames_per_block,
+                         nb::handle dtype, nb::handle out) {
+    check_readable(self);
+    if (frames_per_block <= 0) {
+        throw std::invalid_argument(
+            _format("frames_per_block must be positive, but got %lld",
+                    static_cast<long long>(frames_per_block)));
+    }
+
+    WavpackBlockIterator it;
+    it.reader = &self;
+    it.frames_per_block = frames_per_block;
+    it.format = get_sample_format(self);
+    it.channels = self.GetNumChannels();
+    if (out.is_none()) {
+        it.type =
+            dtype.is_none() ? SampleType::Int32 : parse_sample_type(dtype);
+    } else {
+        it.out = nb::cast<OutputArray>(out);
+        check_output_array(self, it.out);
+        if (it.out.shape(0) < static_cast<size_t>(frames_per_block)) {
+            throw std::invalid_argument(
+                "The array must have at least frames_per_block frames");
+        }
+        it.type = sample_type_of(it.out.dtype());
+        if (!dtype.is_none() && parse_sample_type(dtype) != it.type) {
+            throw std::invalid_argument(
+                "dtype doesn't match the dtype of the given array");
+        }
+        it.out_obj = nb::borrow(out);
+    }
+    return it;
+};
+
+
+// Decode the crop [offset, offset + frames) of a file into "dst", which is an
+// array of "type" with the shape of (frames, channels). If the file is
+// shorter than the crop, the rest is filled with zeros when "pad" is true,
+// otherwise an exception is thrown. This doesn't touch any Python object.
+static void read_crop(const char *infilename, int flags, int norm_offset,
+                      int64_t offset, int64_t frames, int channels,
+                      SampleType type, bool pad, bool use_index, void *dst,
+                      std::vector<int32_t> &scratch) {
+    auto wpcc = WavpackRead(infilename, flags, norm_offset);
+    check_readable(wpcc);
+    if (wpcc.GetNumChannels() != channels) {
+        throw std::invalid_argument(
+            _format("The file has %d channels, but %d channels were expected",
+                    wpcc.GetNumChannels(), channels));
+    }
+    if (use_index && offset > 0 && !(wpcc.GetMode() & MODE_WVC)) {
+        wpcc.SetSeekIndex(get_seek_index(infilename, ""));
+    }
+
+    auto total = wpcc.GetNumSamples64();
+    int64_t done = 0;
+    if (total < 0 || offset < total) {
+        if (offset > 0 && !wpcc.SeekSample64(offset)) {
+            // Past the end of a file of unknown length, which is padded or
+            // rejected below as it is for a known length
+            if (total >= 0) {
+                throw std::runtime_error(
+                    _format("Failed to seek to the sample %lld",
+                            static_cast<long long>(offset)));
+            }
+        } else {
+            done = unpack_converted(wpcc, get_sample_format(wpcc), channels,
+                                    type, dst, frames, scratch);
+        }
+    }
+    if (done < frames) {
+        if (!pad) {
+            throw std::out_of_range(
+                _format("The crop of %lld frames at %lld runs past the end "
+                        "of the file (%lld frames)",
+                        static_cast<long long>(frames),
+                        static_cast<long long>(offset),
+                        static_cast<long long>(total)));
+        }
+        auto frame_size = channels * sample_type_size(type);
+        std::memset(static_cast<uint8_t *>(dst) + done * frame_size, 0,
+                    (frames - done) * frame_size);
+    }
+};
+
+
+// Decode crops[i] = infilenames[i][offsets[i]:offsets[i] + frames] into one
+// array with the shape of (N, frames, channels). Every crop is decoded into
+// its slice of the array in parallel without the GIL, so no intermediate
+// array nor np.stack is needed. If "out" is given, it's filled and returned.
+nb::object wavpack_read_crops(const std::vector<std::string> &infilenames,
+                              const std::vector<int64_t> &offsets,
+                              int64_t frames, nb::handle out,
+                              nb::handle dtype, bool pad, int num_threads,
+                              bool use_index, int flags, int norm_offset,
+                              int worker_threads) {
+    auto n = infilenames.size();
+    if (offsets.size() != n) {
+        throw std::invalid_argument(
+            _format("%zu offsets were given for %zu files", offsets.size(),
+                    n));
+    }
+    if (frames < 0) {
+        throw std::invalid_argument(
+            _format("frames must be non-negative, but got %lld",
+                    static_cast<long long>(frames)));
+    }
+    for (auto offset : offsets) {
+        if (offset < 0) {
+            throw std::invalid_argument(
+                _format("offsets must be non-negative, but got %lld",
+                        static_cast<long long>(offset)));
+        }
+    }
+    flags = with_worker_threads(flags, worker_threads);
+
+    SampleType type;
+    int channels;
+    uint8_t *data;
+    PooledData owned;
+    if (out.is_none()) {
+        if (n == 0) {
+            throw std::invalid_argument(
+                "The number of channels is unknown without files or out");
+        }
+        type = dtype.is_none() ? SampleType::Int32 : parse_sample_type(dtype);
+        {
+            // Take the number of channels from the first file
+            nb::gil_scoped_release release;
+            auto wpcc = WavpackRead(infilenames[0].c_str(), flags & ~OPEN_WVC,
+                                    norm_offset);
+            if (wpcc.GetErrorMessage()[0] != '\0') {
+                throw std::runtime_error(_format(
+                    "%s: %s", infilenames[0].c_str(), wpcc.GetErrorMessage()));
+            }
+            channels = wpcc.GetNumChannels();
+        }
+        owned = pool_allocate(n * frames * channels * sample_type_size(type));
+        data = owned.get();
+    } else {
+        auto array = nb::cast<OutputArray>(out);
+        if (array.ndim() != 3 || array.shape(0) != n ||
+            array.shape(1) != static_cast<size_t>(frames)) {
+            throw std::invalid_argument(
+                _format("The array must be 3-dimensional with the shape of "
+                        "(%zu, %lld, channels)",
+                        n, static_cast<long long>(frames)));
+        }
+        type = sample_type_of(array.dtype());
+        if (!dtype.is_none() && parse_sample_type(dtype) != type) {
+            throw std::invalid_argument(
+                "dtype doesn't match the dtype of the given array");
+        }
+        channels = static_cast<int>(array.shape(2));
+        data = static_cast<uint8_t *>(array.data());
+    }
+
+    auto crop_size = frames * channels * sample_type_size(type);
+    {
+        nb::gil_scoped_release release;
+        parallel_for(n, num_threads, [&](size_t i) {
+            // Reused across the crops decoded by the same thread
+            thread_local std::vector<int32_t> scratch;
+            try {
+                read_crop(infilenames[i].c_str(), flags, norm_offset,
+                          offsets[i], frames, channels, type, pad, use_index,
+                          data + i * crop_size, scratch);
+            } catch (const std::exception &e) {
+                throw std::runtime_error(
+                    _format("%s: %s", infilenames[i].c_str(), e.what()));
+            }
+        });
+    }
+
+    if (!out.is_none()) {
+        return nb::borrow(out);
+    }
+    auto *raw = owned.get();
+    auto owner = pooled_owner(owned);
+    size_t shape[3] = {n, static_cast<size_t>(frames),
+                       static_cast<size_t>(channels)};
+    return nb::cast(nb::ndarray<nb::numpy>(raw, 3, shape, owner, nullptr,
+                                           sample_type_dtype(type)));
+};
+
+
+// The properties of a file taken from the header of the first block (and the
+// tags at the end of the file), without decoding any audio
+struct WavpackInfo {
+    int64_t num_samples = -1;
+    uint32_t sample_rate = 0;
+    int channels = 0;
+    int bits_per_sample = 0;
+    int bytes_per_sample = 0;
+    int mode = 0;
+    int channel_mask = 0;
+    int64_t file_size = 0;
+    // Hexadecimal, or empty if the file has no MD5 checksum
+    std::string md5;
+    std::map<std::string, std::string> tags;
+};
+
+static std::string to_hex(const unsigned char *data, size_t size) {
+    static const char *hex_digits = "0123456789abcdef";
+    std::string hex;
+    for (size_t i = 0; i < size; i++) {
+        hex += hex_digits[data[i] >> 4];
+        hex += hex_digits[data[i] & 15];
+    }
+    return hex;
+};
+
+// The MD5 checksum is stored in the last block, so looking it up costs a seek
+// to the end of the file and is skipped unless "md5" is true.
+static WavpackInfo get_info(const char *infilename, bool md5, bool tags) {
+    // Neither the correction file nor the normalization is needed
+    auto wpcc = WavpackRead(infilename, tags ? OPEN_TAGS : 0, 0);
+    check_readable(wpcc);
+
+    WavpackInfo info;
+    info.num_samples = wpcc.GetNumSamples64();
+    info.sample_rate = wpcc.GetNativeSampleRate();
+    info.channels = wpcc.GetNumChannels();
+    info.bits_per_sample = wpcc.GetBitsPerSample();
+    info.bytes_per_sample = wpcc.GetBytesPerSample();
+    info.mode = wpcc.GetMode();
+    info.channel_mask = wpcc.GetChannelMask();
+    info.file_size = wpcc.GetFileSize64();
+
+    unsigned char digest[16];
+    if (md5 && wpcc.GetMd5sum(digest)) {
+        info.md5 = to_hex(digest, 16);
+    }
+    if (tags) {
+        auto count = wpcc.GetNumTagItems();
+        for (int i = 0; i < count; i++) {
+            auto item = wpcc.GetTagItemIndexed(i);
+            info.tags[item] = wpcc.GetTagItem(item.c_str());
+        }
+    }
+    return info;
+};
+
+
+// Move a vector into a 1d numpy array without copying
+template <typename T>
+static nb::object to_column(std::vector<T> &&values) {
+    auto *owned = new std::vector<T>(std::move(values));
+    nb::capsule owner(owned, [](void *p) noexcept {
+        delete static_cast<std::vector<T> *>(p);
+    });
+    size_t shape[1] = {owned->size()};
+    return nb::cast(nb::ndarray<nb::numpy, T>(owned->data(), 1, shape, owner));
+};
+
+
+// Get the info of many files in parallel as columns, i.e. a dict of arrays
+// (and lists for "md5" and "tags") which can be passed to pandas.DataFrame
+// or pyarrow.table as they are. With errors="ignore", the rows of the files
+// which can't be opened are filled with zeros and "ok" is False.
+auto wavpack_info_many(const std::vector<std::string> &infilenames,
+                       int num_threads, bool md5, bool tags,
+                       const std::string &errors) {
+    if (errors != "raise" && errors != "ignore") {
+        throw std::invalid_argument(
+            _format("errors must be \"raise\" or \"ignore\", but got \"%s\"",
+                    errors.c_str()));
+    }
+    auto n = infilenames.size();
+    std::vector<WavpackInfo> infos(n);
+    std::vector<uint8_t> ok(n, 1);
+    {
+        nb::gil_scoped_release release;
+        parallel_for(n, num_threads, [&](size_t i) {
+            try {
+                infos[i] = get_info(infilenames[i].c_str(), md5, tags);
+            } catch (const std::exception &e) {
+                if (errors == "ignore") {
+                    infos[i] = WavpackInfo();
+                    infos[i].num_samples = 0;
+                    ok[i] = 0;
+                    return;
+                }
+                throw std::runtime_error(
+                    _format("%s: %s", infilenames[i].c_str(), e.what()));
+            }
+        });
+    }
+
+    std::vector<int64_t> num_samples(n), file_size(n);
+    std::vector<uint32_t> sample_rate(n);
+    std::vector<int32_t> channels(n), bits_per_sample(n), bytes_per_sample(n),
+        mode(n), channel_mask(n);
+    for (size_t i = 0; i < n; i++) {
+        num_samples[i] = infos[i].num_samples;
+        file_size[i] = infos[i].file_size;
+        sample_rate[i] = infos[i].sample_rate;
+        channels[i] = infos[i].channels;
+        bits_per_sample[i] = infos[i].bits_per_sample;
+        bytes_per_sample[i] = infos[i].bytes_per_sample;
+        mode[i] = infos[i].mode;
+        channel_mask[i] = infos[i].channel_mask;
+    }
+
+    nb::dict columns;
+    columns["num_samples"] = to_column(std::move(num_samples));
+    columns["sample_rate"] = to_column(std::move(sample_rate));
+    columns["channels"] = to_column(std::move(channels));
+    columns["bits_per_sample"] = to_column(std::move(bits_per_sample));
+    columns["bytes_per_sample"] = to_column(std::move(bytes_per_sample));
+    columns["mode"] = to_column(std::move(mode));
+    columns["channel_mask"] = to_column(std::move(channel_mask));
+    columns["file_size"] = to_column(std::move(file_size));
+    columns["ok"] = to_column(std::move(ok)).attr("astype")("bool");
+    if (md5) {
+        nb::list md5s;
+        for (auto &info : infos) {
+            md5s.append(nb::str(info.md5.c_str()));
+        }
+        columns["md5"] = md5s;
+    }
+    if (tags) {
+        nb::list dicts;
+        for (auto &info : infos) {
+            dicts.append(nb::cast(info.tags));
+        }
+        columns["tags"] = dicts;
+    }
+    return columns;
+};
+
+
+// The selection of getitem along one axis, i.e. the indices start,
+// start + step, ..., and whether the axis is dropped (an integer key)
+struct AxisKey {
+    int64_t start;
+    int64_t step;
+    int64_t length;
+    bool scalar;
+};
+
+static AxisKey parse_axis_key(nb::handle key, int64_t size,
+                              const char *axis) {
+    if (key.is_none()) {
+        throw nb::index_error("None (numpy.newaxis) isn't supported");
+    }
+    if (key.ptr() == Py_Ellipsis) {
+        return AxisKey{0, 1, size, false};
+    }
+    if (PySlice_Check(key.ptr())) {
+        Py_ssize_t start, stop, step;
+        if (PySlice_Unpack(key.ptr(), &start, &stop, &step) < 0) {
+            throw nb::python_error();
+        }
+        auto length = PySlice_AdjustIndices(static_cast<Py_ssize_t>(size),
+                                            &start, &stop, step);
+        return AxisKey{start, step, length, false};
+    }
+    auto index = nb::cast<int64_t>(key);
+    if (index < 0) {
+        index += size;
+    }
+    if (index < 0 || index >= size) {
+        throw nb::index_error(
+            _format("The index %lld is out of range for the %s axis with "
+                    "the size of %lld",
+                    static_cast<long long>(nb::cast<int64_t>(key)), axis,
+                    static_cast<long long>(size))
+                .c_str());
+    }
+    return AxisKey{index, 1, 1, true};
+};
+
+
+// A file viewed as a read-only array of (frames, channels). The file is
+// memory-mapped and only the blocks overlapping a selection are decoded.
+// The decoded blocks are kept in an LRU cache bounded by "cache_size" bytes,
+// so that scrubbing back and forth doesn't decode the same blocks again.
+struct WavpackArray {
+    std::unique_ptr<MappedFile> _file;
+    std::unique_ptr<WavpackRead> _reader;
+    std::shared_ptr<WavpackSeekIndex> _index;
+    SampleType _type;
+    SampleFormat _sample_format;
+    int _channels;
+    uint32_t _sample_rate;
+    std::vector<int32_t> _scratch;
+
+    // Keys of the blocks ordered from the most recently used one
+    std::list<int64_t> _lru;
+    std::unordered_map<int64_t,
+                       std::pair<std::shared_ptr<std::vector<uint8_t>>,
+                                 std::list<int64_t>::iterator>>
+        _cache;
+    size_t _cache_size;
+    size_t _cached_bytes = 0;
+    int64_t _hits = 0;
+    int64_t _misses = 0;
+    // Decoding is done without the GIL, so the reader and the cache are
+    // guarded by the mutex
+    std::mutex _mutex;
+
+    WavpackArray(const char *infilename, SampleType type, int flags,
+                 int norm_offset, size_t cache_size)
+        : _type(type), _cache_size(cache_size) {
+        _file.reset(new MappedFile(infilename));
+        // Index the mapped file, unless an up-to-date index is cached
+        _index = get_seek_index(infilename, "", _file->data, _file->size);
+        if (static_cast<size_t>(_index->file_size) != _file->size) {
+            _index = WavpackSeekIndex::build_from_memory(_file->data,
+                                                         _file->size);
+        }
+        _reader.reset(new WavpackRead(_file->data, _file->size, nullptr, 0,
+                                      flags & ~OPEN_WVC, norm_offset));
+        check_readable(*_reader);
+        _reader->SetSeekIndex(_index);
+        _sample_format = get_sample_format(*_reader);
+        _channels = _reader->GetNumChannels();
+        _sample_rate = _reader->GetNativeSampleRate();
+    };
+    WavpackArray(const WavpackArray &) = delete;
+
+    int64_t NumFrames() { return _index->total_samples; };
+
+    // Get the decoded block of the index entry "i". The mutex must be held.
+    std::shared_ptr<std::vector<uint8_t>> _get_block(int64_t i) {
+        auto it = _cache.find(i);
+        if (it != _cache.end()) {
+            _hits++;
+            _lru.splice(_lru.begin(), _lru, it->second.second);
+            return it->second.first;
+        }
+        _misses++;
+
+        auto &entry = _index->entries[i];
+        if (_reader->GetSampleIndex64() != entry.block_index &&
+            !_reader->SeekSample64(entry.block_index)) {
+            throw std::runtime_error(
+                _format("Failed to seek to the sample %lld",
+                        static_cast<long long>(entry.block_index)));
+        }
+        auto block = std::make_shared<std::vector<uint8_t>>(
+            entry.block_samples * _channels * sample_type_size(_type));
+        auto done = unpack_converted(*_reader, _sample_format, _channels,
+                                     _type, block->data(),
+                                     entry.block_samples, _scratch);
+        if (done != entry.block_samples) {
+            throw std::runtime_error(
+                _format("UnpackSamples returned %lld samples, but %lld "
+                        "samples were expected",
+                        static_cast<long long>(done),
+                        static_cast<long long>(entry.block_samples)));
+        }
+
+        // Evict the least recently used blocks to make room for this one
+        while (!_lru.empty() && _cached_bytes + block->size() > _cache_size) {
+            auto last = _cache.find(_lru.back());
+            _cached_bytes -= last->second.first->size();
+            _cache.erase(last);
+            _lru.pop_back();
+        }
+        if (block->size() <= _cache_size) {
+            _lru.push_front(i);
+            _cache[i] = std::make_pair(block, _lru.begin());
+            _cached_bytes += block->size();
+        }
+        return block;
+    };
+
+    // Copy the selected samples into "dst" as (frames.length, channels.length)
+    void Take(const AxisKey &frames, const AxisKey &channels, uint8_t *dst) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_reader) {
+            throw std::runtime_error("The array is already closed");
+        }
+        auto item_size = sample_type_size(_type);
+        auto row_size = channels.length * item_size;
+        // In ptrdiff_t because the step of channels may be negative
+        auto item = static_cast<ptrdiff_t>(item_size);
+        int64_t j = 0;
+        while (j < frames.length) {
+            auto i = _index->find(frames.start + j * frames.step);
+            if (i < 0) {
+                throw std::runtime_error("The seek index is broken");
+            }
+            auto &entry = _index->entries[i];
+            auto block = _get_block(i);
+            // Copy all the selected frames in this block
+            for (; j < frames.length; j++) {
+                auto frame = frames.start + j * frames.step - entry.block_index;
+                if (frame < 0 || frame >= entry.block_samples) {
+                    break;
+                }
+                auto *src = block->data() +
+                            (frame * _channels + channels.start) * item;
+                auto *out = dst + j * row_size;
+                if (channels.step == 1) {
+                    std::memcpy(out, src, row_size);
+                    continue;
+                }
+                for (int64_t c = 0; c < channels.length; c++) {
+                    std::memcpy(out + c * item, src + c * channels.step * item,
+                                item_size);
+                }
+            }
+        }
+    };
+
+    nb::object GetItem(nb::handle key) {
+        nb::handle frames_key = key;
+        nb::handle channels_key = Py_Ellipsis;
+        if (nb::isinstance<nb::tuple>(key)) {
+            // Borrowed references which live as long as "key"
+            auto n = PyTuple_Size(key.ptr());
+            if (n > 2) {
+                throw nb::index_error("Too many indices for a 2d array");
+            }
+            if (n > 0) {
+                frames_key = PyTuple_GetItem(key.ptr(), 0);
+            } else {
+                frames_key = Py_Ellipsis;
+            }
+            if (n > 1) {
+                channels_key = PyTuple_GetItem(key.ptr(), 1);
+            }
+        }
+        auto frames = parse_axis_key(frames_key, NumFrames(), "frames");
+        auto channels = parse_axis_key(channels_key, _channels, "channels");
+        return _take(frames, channels);
+    };
+
+    nb::object _take(const AxisKey &frames, const AxisKey &channels) {
+        auto size = frames.length * channels.length * sample_type_size(_type);
+        auto data = pool_allocate(size);
+        {
+            nb::gil_scoped_release release;
+            Take(frames, channels, data.get());
+        }
+
+        auto *raw = data.get();
+        auto owner = pooled_owner(data);
+        size_t shape[2];
+        size_t ndim = 0;
+        if (!frames.scalar) {
+            shape[ndim++] = static_cast<size_t>(frames.length);
+        }
+        if (!channels.scalar) {
+            shape[ndim++] = static_cast<size_t>(channels.length);
+        }
+        auto array = nb::cast(nb::ndarray<nb::numpy>(
+            raw, ndim, shape, owner, nullptr, sample_type_dtype(_type)));
+        if (ndim == 0) {
+            // A numpy scalar as numpy does for a[i, j]
+            return array.attr("__getitem__")(nb::make_tuple());
+        }
+        return array;
+    };
+
+    nb::object ToArray() {
+        return _take(AxisKey{0, 1, NumFrames(), false},
+                     AxisKey{0, 1, _channels, false});
+    };
+
+    auto CacheInfo() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return std::make_tuple(_hits, _misses,
+                               static_cast<int64_t>(_cache.size()),
+                               static_cast<int64_t>(_cached_bytes));
+    };
+
+    void Close() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        // The reader must be closed before unmapping the file
+        _reader.reset();
+        _file.reset();
+        _cache.clear();
+        _lru.clear();
+        _cached_bytes = 0;
+    };
+};
+
+
+// Convert an exception thrown in a native thread into a Python exception
+// object in the same way as nanobind translates it. The GIL is needed.
+static nb::object exception_to_python(std::exception_ptr error) {
+    try {
+        std::rethrow_exception(error);
+    } catch (const std::invalid_argument &e) {
+        return nb::handle(PyExc_ValueError)(e.what());
+    } catch (const std::out_of_range &e) {
+        return nb::handle(PyExc_IndexError)(e.what());
+    } catch (const std::bad_alloc &) {
+        return nb::handle(PyExc_MemoryError)();
+    } catch (const std::exception &e) {
+        return nb::handle(PyExc_RuntimeError)(e.what());
+    } catch (...) {
+        return nb::handle(PyExc_RuntimeError)("Unknown error");
+    }
+};
+
+
+// Native threads running the decoding for the asyncio interface. The number
+// of threads is fixed so that concurrent requests don't oversubscribe the
+// cores. The threads are started on the first task and never joined, but
+// stop() is called at exit so that they don't take the GIL while the
+// interpreter is finalizing.
+struct AsyncTaskQueue {
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::condition_variable idle;
+    std::deque<std::function<void()>> tasks;
+    size_t num_threads = 0;
+    size_t num_callbacks = 0;
+    bool stopping = false;
+
+    void submit(std::function<void()> task) {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(std::move(task));
+        if (num_threads == 0) {
+            num_threads = std::max(1u, std::thread::hardware_concurrency());
+            for (size_t i = 0; i < num_threads; i++) {
+                std::thread([this]() { run(); }).detach();
+            }
+        }
+        ready.notify_one();
+    };
+
+    void run() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [this]() { return !tasks.empty(); });
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    };
+
+    // Called by a task before taking the GIL, and end_callback() after
+    // releasing it. Returns false after stop(), and then the task must not
+    // touch Python objects.
+    bool begin_callback() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopping) {
+            return false;
+        }
+        num_callbacks++;
+        return true;
+    };
+
+    void end_callback() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--num_callbacks == 0) {
+            idle.notify_all();
+        }
+    };
+
+    // Drop the pending tasks and wait for the running callbacks. Called with
+    // the GIL at exit. The callbacks of the dropped and running tasks are
+    // leaked.
+    void stop() {
+        nb::gil_scoped_release release;
+        std::unique_lock<std::mutex> lock(mutex);
+        stopping = true;
+        tasks.clear();
+        idle.wait(lock, [this]() { return num_callbacks == 0; });
+    };
+};
+
+// Never destroyed, because the detached threads keep using it
+static AsyncTaskQueue &async_tasks = *new AsyncTaskQueue();
+
+
+// Decode a file on a native thread and call "callback(result, error)" with
+// the GIL from that thread, where "result" is (array, sample_rate) and
+// "error" is an exception object or None. Returns immediately.
+void wavpack_read_async(nb::handle callback, const std::string &infilename,
+                        int flags, int norm_offset, int64_t start,
+                        int64_t frames, nb::handle dtype, int worker_threads,
+                        bool use_index, int num_threads, nb::handle channels,
+                        const std::string &layout) {
+    auto type = parse_sample_type(dtype);
+    auto channel_layout = parse_channel_layout(channels, layout);
+    flags = with_worker_threads(flags, worker_threads);
+    // The reference is owned by the task and released with the GIL
+    auto *owned_callback = nb::borrow(callback).release().ptr();
+    async_tasks.submit([=]() {
+        DecodedAudio audio;
+        std::exception_ptr error;
+        try {
+            audio = read_file(infilename.c_str(), flags, norm_offset, start,
+                              frames, type, use_index, num_threads,
+                              channel_layout);
+        } catch (...) {
+            error = std::current_exception();
+        }
+
+        if (!async_tasks.begin_callback()) {
+            return;
+        }
+        {
+            nb::gil_scoped_acquire acquire;
+            auto fn = nb::steal(owned_callback);
+            try {
+                nb::object result;
+                if (!error) {
+                    try {
+                        result = nb::cast(to_ndarray(audio));
+                    } catch (...) {
+                        error = std::current_exception();
+                    }
+                }
+                if (error) {
+                    fn(nb::none(), exception_to_python(error));
+                } else {
+                    fn(result, nb::none());
+                }
+            } catch (nb::python_error &e) {
+                e.discard_as_unraisable("pywavpack_ext.read_async");
+            } catch (...) {
+                auto exc = exception_to_python(std::current_exception());
+                PyErr_SetObject(reinterpret_cast<PyObject *>(
+                                    Py_TYPE(exc.ptr())),
+                                exc.ptr());
+                nb::python_error().discard_as_unraisable(
+                    "pywavpack_ext.read_async");
+            }
+        }
+        async_tasks.end_callback();
+    });
+};
+
+
+struct BlockPrefetcher;
+
+// The live prefetchers, which are closed at exit for the same reason as
+// async_tasks. Never destroyed, like async_tasks.
+static std::mutex &prefetchers_mutex = *new std::mutex();
+static std::unordered_set<BlockPrefetcher *> &prefetchers =
+    *new std::unordered_set<BlockPrefetcher *>();
+
+
+// Decode chunks of a file on a dedicated native thread ahead of the
+// consumer, keeping up to "prefetch" chunks in a queue. The file is opened
+// and decoded without the GIL, which is taken only to call "notify()" after
+// a chunk is queued, at the end or on an error. The consumer takes the
+// chunks with Poll(), typically from notify() via an event loop.
+struct BlockPrefetcher {
+    std::string _infilename;
+    int _flags;
+    int _norm_offset;
+    int64_t _start;
+    int64_t _frames_per_block;
+    SampleType _type;
+    size_t _prefetch;
+    // A strong reference released in the destructor with the GIL
+    PyObject *_notify;
+
+    std::mutex _mutex;
+    std::condition_variable _not_full;
+    std::deque<DecodedAudio> _queue;
+    bool _finished = false;
+    bool _stopped = false;
+    std::exception_ptr _error;
+    // Serializes Close() from the owner and from close_prefetchers()
+    std::mutex _close_mutex;
+    std::thread _thread;
+
+    BlockPrefetcher(const std::string &infilename, int flags,
+                    int norm_offset, int64_t start, int64_t frames_per_block,
+                    SampleType type, size_t prefetch, nb::handle notify)
+        : _infilename(infilename), _flags(flags), _norm_offset(norm_offset),
+          _start(start), _frames_per_block(frames_per_block), _type(type),
+          _prefetch(std::max(prefetch, static_cast<size_t>(1))),
+          _notify(nb::borrow(notify).release().ptr()) {
+        _thread = std::thread([this]() { _run(); });
+        std::lock_guard<std::mutex> lock(prefetchers_mutex);
+        prefetchers.insert(this);
+    };
+    BlockPrefetcher(const BlockPrefetcher &) = delete;
+
+    void _run() {
+        try {
+            auto wpcc = WavpackRead(_infilename.c_str(), _flags, _norm_offset);
+            check_readable(wpcc);
+            if (_start > 0 && !wpcc.SeekSample64(_start)) {
+                throw std::runtime_error(
+                    _format("Failed to seek to the sample %lld",
+                            static_cast<long long>(_start)));
+            }
+            auto format = get_sample_format(wpcc);
+            auto channels = wpcc.GetNumChannels();
+            auto sample_rate = wpcc.GetNativeSampleRate();
+            std::vector<int32_t> scratch;
+            while (true) {
+                {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    _not_full.wait(lock, [this]() {
+                        return _stopped || _queue.size() < _prefetch;
+                    });
+                    if (_stopped) {
+                        return;
+                    }
+                }
+                DecodedAudio audio;
+                audio.type = _type;
+                audio.channels = channels;
+                audio.sample_rate = sample_rate;
+                audio.data = pool_allocate(_frames_per_block * channels *
+                                           sample_type_size(_type));
+                audio.frames =
+                    unpack_converted(wpcc, format, channels, _type,
+                                     audio.data.get(), _frames_per_block,
+                                     scratch);
+                if (audio.frames == 0) {
+                    break;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _queue.push_back(std::move(audio));
+                }
+                _notify_consumer();
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _error = std::current_exception();
+        }
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _finished = true;
+        }
+        _notify_consumer();
+    };
+
+    void _notify_consumer() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_stopped) {
+                return;
+            }
+        }
+        nb::gil_scoped_acquire acquire;
+        try {
+            nb::handle notify(_notify);
+            notify();
+        } catch (nb::python_error &e) {
+            e.discard_as_unraisable("pywavpack_ext.BlockPrefetcher");
+        }
+    };
+
+    // Take the next chunk. Returns None if it's not decoded yet, and raises
+    // StopIteration at the end. The GIL is needed.
+    nb::object Poll() {
+        DecodedAudio audio;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_queue.empty()) {
+                if (_error) {
+                    auto error = _error;
+                    _error = nullptr;
+                    std::rethrow_exception(error);
+                }
+                if (_finished || _stopped) {
+                    throw nb::stop_iteration();
+                }
+                return nb::none();
+            }
+            audio = std::move(_queue.front());
+            _queue.pop_front();
+        }
+        _not_full.notify_one();
+        return nb::cast(std::get<0>(to_ndarray(audio)));
+    };
+
+    // Stop the thread and drop the queued chunks. Called without the GIL.
+    void Close() {
+        std::lock_guard<std::mutex> close_lock(_close_mutex);
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopped = true;
+        }
+        _not_full.notify_all();
+        if (_thread.joinable()) {
+            _thread.join();
+        }
+        std::lock_guard<std::mutex> lock(_mutex);
+        _queue.clear();
+    };
+
+    ~BlockPrefetcher() {
+        {
+            // The thread may be waiting for the GIL in _notify_consumer()
+            nb::gil_scoped_release release;
+            {
+                std::lock_guard<std::mutex> lock(prefetchers_mutex);
+                prefetchers.erase(this);
+            }
+            Close();
+        }
+        Py_XDECREF(_notify);
+    };
+};
+
+// Stop the threads of the live prefetchers. Called with the GIL at exit, so
+// that they don't take the GIL while the interpreter is finalizing. The
+// prefetchers stay usable, but Poll() raises StopIteration.
+static void close_prefetchers() {
+    nb::gil_scoped_release release;
+    std::lock_guard<std::mutex> lock(prefetchers_mutex);
+    for (auto *prefetcher : prefetchers) {
+        prefetcher->Close();
+    }
+};
+
+
+// Feed samples into MD5 as they are stored in the original file, i.e.
+// little-endian in "bytes_per_sample" bytes and unsigned if 8-bit unless
+// "qmode" has QMODE_BIG_ENDIAN or QMODE_SIGNED_BYTES, in the same way as
+// wvunpack computes the checksum.
+static void md5_update_samples(MD5Context &md5, const int32_t *samples,
+                               size_t count, int bytes_per_sample,
+                               int qmode = 0) {
+    auto big_endian = (qmode & QMODE_BIG_ENDIAN) != 0;
+    auto offset = (qmode & QMODE_SIGNED_BYTES) ? 0u : 128u;
+    unsigned char buffer[4096];
+    auto per_buffer = sizeof(buffer) / bytes_per_sample;
+    while (count > 0) {
+        auto n = std::min(count, per_buffer);
+        auto *p = buffer;
+        for (size_t i = 0; i < n; i++) {
+            auto value = static_cast<uint32_t>(samples[i]);
+            if (bytes_per_sample == 1) {
+                *p++ = static_cast<unsigned char>(value + offset);
+                continue;
+            }
+            for (int j = 0; j < bytes_per_sample; j++) {
+                auto shift = big_endian ? bytes_per_sample - 1 - j : j;
+                *p++ = static_cast<unsigned char>(value >> (8 * shift));
+            }
+        }
+        md5.update(buffer, n * bytes_per_sample);
+        samples += n;
+        count -= n;
+    }
+};
+
+
+// A read-only C-contiguous array on CPU given by the user
+using InputArray = nb::ndarray<nb::ro, nb::c_contig, nb::device::cpu>;
+
+// Convert the user's samples into the int32 values for PackSamples, i.e.
+// right-justified integers in the container of (bits_per_sample + 7) / 8
+// bytes, or the bit patterns of float32. int16 is the full scale of 16 bits
+// and shifted to the container, int32 is taken as it is but must fit in it,
+// and float input for an integer file is the inverse of the normalization in
+// convert_to_float().
+static void convert_input(const void *src, SampleType type, int32_t *dst,
+                          size_t count, bool is_float, int bits_per_sample) {
+    if (is_float) {
+        // int32 is only given internally, as the bit patterns of float
+        if (type == SampleType::Float32 || type == SampleType::Int32) {
+            std::memcpy(dst, src, count * sizeof(float));
+        } else {
+            auto *in = static_cast<const double *>(src);
+            for (size_t i = 0; i < count; i++) {
+                auto value = static_cast<float>(in[i]);
+                std::memcpy(&dst[i], &value, sizeof(float));
+            }
+        }
+        return;
+    }
+
+    auto container_bits = (bits_per_sample + 7) / 8 * 8;
+    switch (type) {
+    case SampleType::Int32: {
+        std::memcpy(dst, src, count * sizeof(int32_t));
+        if (container_bits >= 32) {
+            break;
+        }
+        int32_t low = 0, high = 0;
+        for (size_t i = 0; i < count; i++) {
+            low = std::min(low, dst[i]);
+            high = std::max(high, dst[i]);
+        }
+        auto limit = int32_t(1) << (container_bits - 1);
+        if (low < -limit || high > limit - 1) {
+            throw std::invalid_argument(
+                _format("int32 samples must be in [%d, %d] for "
+                        "bits_per_sample=%d, but got [%d, %d]",
+                        -limit, limit - 1, bits_per_sample, low, high));
+        }
+        break;
+    }
+    case SampleType::Int16: {
+        if (container_bits < 16) {
+            throw std::invalid_argument(
+                _format("int16 arrays can't be written with "
+                        "bits_per_sample=%d",
+                        bits_per_sample));
+        }
+        auto *in = static_cast<const int16_t *>(src);
+        auto scale = int32_t(1) << (container_bits - 16);
+        for (size_t i = 0; i < count; i++) {
+            dst[i] = in[i] * scale;
+        }
+        break;
+    }
+    case SampleType::Float32:
+    case SampleType::Float64: {
+        auto scale = std::ldexp(1.0, container_bits - 1);
+        auto low = -scale;
+        auto high = scale - 1.0;
+        for (size_t i = 0; i < count; i++) {
+            double value = type == SampleType::Float32
+                               ? static_cast<const float *>(src)[i]
+                               : static_cast<const double *>(src)[i];
+            value = std::min(std::max(value * scale, low), high);
+            dst[i] = static_cast<int32_t>(std::lrint(value));
+        }
+        break;
+    }
+    }
+};
+
+
+// "fast", "normal", "high" and "very_high" correspond to -f, (none), -h and
+// -hh of the wavpack command
+static int parse_encode_mode(const std::string &mode) {
+    if (mode == "fast") {
+        return CONFIG_FAST_FLAG;
+    } else if (mode == "normal") {
+        return 0;
+    } else if (mode == "high") {
+        return CONFIG_HIGH_FLAG;
+    } else if (mode == "very_high") {
+        return CONFIG_HIGH_FLAG | CONFIG_VERY_HIGH_FLAG;
+    }
+    throw std::invalid_argument(
+        _format("mode must be one of fast, normal, high or very_high, but "
+                "got %s",
+                mode.c_str()));
+};
+
+
+// The settings of the encoder, which are common to all the writing functions
+struct EncodeOptions {
+    // The number of valid bits of integer samples, or 32 for float
+    int bits_per_sample = 16;
+    bool is_float = false;
+    // One of "fast", "normal", "high" and "very_high"
+    std::string mode = "normal";
+    // 0 (disabled) to 6, the same as -x of the wavpack command
+    int extra = 0;
+    // 0 for lossless. Otherwise the hybrid mode is enabled and the value means
+    // bits per sample if less than 24 or kbps otherwise.
+    double bitrate = 0;
+    // Create the correction file as outfilename + "c"
+    bool wvc = false;
+    bool md5 = false;
+    // The checksum is given by SetMD5Sum() instead of computed from the
+    // packed samples. Only meaningful with "md5".
+    bool md5_supplied = false;
+    int channel_mask = 0;
+    // Additional threads used by the library to encode the channels of
+    // multichannel files in parallel (0 to 15)
+    int worker_threads = 0;
+    // Only set by compress_file() to describe the original file: QMODE_*
+    // flags, and the extension and WP_FORMAT_* if it isn't a WAV file
+    int qmode = 0;
+    std::string file_extension;
+    unsigned char file_format = WP_FORMAT_WAV;
+};
+
+// The options given as the keyword arguments of the writing functions
+static EncodeOptions make_encode_options(int bits_per_sample, bool is_float,
+                                         const std::string &mode, int extra,
+                                         double bitrate, bool wvc, bool md5,
+                                         int channel_mask,
+                                         int worker_threads) {
+    EncodeOptions options;
+    options.bits_per_sample = bits_per_sample;
+    options.is_float = is_float;
+    options.mode = mode;
+    options.extra = extra;
+    options.bitrate = bitrate;
+    options.wvc = wvc;
+    options.md5 = md5;
+    options.channel_mask = channel_mask;
+    options.worker_threads = worker_threads;
+    return options;
+}
+
+struct WavpackWrite {
+  private:
+    // See WavpackRead for the reason why void* is used
+    void *_wpc;
+    write_id _wv_file;
+    write_id _wvc_file;
+    std::string _filename;
+    int _channels;
+    int _bits_per_sample;
+    int _bytes_per_sample;
+    bool _is_float;
+    // Whether the checksum is stored, and whether it's computed here
+    bool _store_md5;
+    bool _md5;
+    int _qmode;
+    MD5Context _md5_context;
+    // The checksum given by SetMD5Sum(), which is stored instead of the one
+    // of the packed samples
+    bool _has_digest = false;
+    unsigned char _digest[16];
+    int64_t _total_samples;
+    int64_t _written;
+    std::vector<int32_t> _scratch;
+
+    void _close_streams() {
+        if (_wpc != nullptr) {
+            WavpackCloseFile(static_cast<WavpackContext *>(_wpc));
+            _wpc = nullptr;
+        }
+        for (auto *wid : {&_wv_file, &_wvc_file}) {
+            if (wid->file != nullptr) {
+                DoCloseHandle(wid->file);
+                wid->file = nullptr;
+            }
+        }
+    };
+
+    void _throw_error(const std::string &message) {
+        auto error = message;
+        if (_wpc != nullptr) {
+            auto *detail =
+                WavpackGetErrorMessage(static_cast<WavpackContext *>(_wpc));
+            if (detail != nullptr && detail[0] != '\0') {
+                error += ": " + std::string(detail);
+            }
+        }
+        _close_streams();
+        throw std::runtime_error(_filename + ": " + error);
+    };
+
+    // Rewrite the first block after WavpackUpdateNumSamples() patched it
+    void _rewrite_first_block(write_id &wid) {
+        if ((wid.file == nullptr && !wid.in_memory) ||
+            wid.first_block.empty()) {
+            return;
+        }
+        WavpackUpdateNumSamples(static_cast<WavpackContext *>(_wpc),
+                                wid.first_block.data());
+        if (wid.in_memory) {
+            std::memcpy(wid.buffer.data(), wid.first_block.data(),
+                        wid.first_block.size());
+            return;
+        }
+        uint32_t bcount;
+        if (fseek(wid.file, 0, SEEK_SET) != 0 ||
+            !DoWriteFile(wid.file, wid.first_block.data(),
+                         static_cast<uint32_t>(wid.first_block.size()),
+                         &bcount) ||
+            bcount != wid.first_block.size()) {
+            _throw_error("Failed to update the first block");
+        }
+    };
+
+  public:
+    // total_frames is the number of samples per channel if known, or -1. The
+    // header is updated when the file is closed if it doesn't match.
+    // If outfilename is nullptr, the stream is encoded into memory and taken
+    // by TakeBuffer() after closing.
+    WavpackWrite(const char *outfilename, uint32_t sample_rate, int channels,
+                 int64_t total_frames, const EncodeOptions &options)
+        : _wpc(nullptr), _filename(outfilename ? outfilename : "<memory>"),
+          _channels(channels),
+          _bits_per_sample(options.bits_per_sample),
+          _is_float(options.is_float), _store_md5(options.md5),
+          _md5(options.md5 && !options.md5_supplied),
+          _qmode(options.qmode), _total_samples(total_frames), _written(0) {
+        auto bits_per_sample = options.bits_per_sample;
+        auto extra = options.extra;
+        auto bitrate = options.bitrate;
+        auto wvc = options.wvc;
+        auto channel_mask = options.channel_mask;
+        if (channels <= 0 || channels > WAVPACK_MAX_CHANS) {
+            throw std::invalid_argument(
+                _format("Invalid number of channels: %d", channels));
+        }
+        if (_is_float ? bits_per_sample != 32
+                      : bits_per_sample < 1 || bits_per_sample > 32) {
+            throw std::invalid_argument(
+                _format("Invalid bits_per_sample: %d", bits_per_sample));
+        }
+        if (extra < 0 || extra > 6) {
+            throw std::invalid_argument(
+                _format("extra must be 0 to 6, but got %d", extra));
+        }
+        if (wvc && bitrate <= 0) {
+            throw std::invalid_argument("wvc requires the hybrid mode");
+        }
+        if (wvc && outfilename == nullptr) {
+            throw std::invalid_argument(
+                "wvc can't be used when encoding into memory");
+        }
+        _bytes_per_sample = (bits_per_sample + 7) / 8;
+
+        WavpackConfig config;
+        std::memset(&config, 0, sizeof(config));
+        config.flags = parse_encode_mode(options.mode);
+        config.sample_rate = static_cast<int32_t>(sample_rate);
+        config.num_channels = channels;
+        config.bits_per_sample = bits_per_sample;
+        config.bytes_per_sample = _bytes_per_sample;
+        if (_is_float) {
+            config.float_norm_exp = 127;
+        }
+        if (channel_mask == 0 && channels <= 2) {
+            channel_mask = channels == 1 ? 0x4 : 0x3;
+        }
+        config.channel_mask = channel_mask;
+        config.qmode = options.qmode;
+        if (extra > 0) {
+            config.flags |= CONFIG_EXTRA_MODE;
+            config.xmode = extra;
+        }
+        if (bitrate > 0) {
+            config.flags |= CONFIG_HYBRID_FLAG;
+            config.bitrate = static_cast<float>(bitrate);
+            if (bitrate >= 24) {
+                config.flags |= CONFIG_BITRATE_KBPS;
+            }
+            if (wvc) {
+                config.flags |= CONFIG_CREATE_WVC;
+            }
+        }
+        if (_store_md5) {
+            config.flags |= CONFIG_MD5_CHECKSUM;
+        }
+#ifdef OPEN_THREADS_SHFT
+        config.worker_threads = std::min(std::max(options.worker_threads, 0),
+                                         15);
+#endif
+
+        if (outfilename == nullptr) {
+            _wv_file.in_memory = true;
+        } else {
+            // "w+b" because the first block may be rewritten when closing
+            _wv_file.file = fopen(outfilename, "w+b");
+            if (_wv_file.file == nullptr) {
+                _throw_error("Failed to open");
+            }
+            _wv_file.buffer.reserve(write_buffer_size);
+        }
+        if (wvc) {
+            auto wvc_filename = _filename + "c";
+            _wvc_file.file = fopen(wvc_filename.c_str(), "w+b");
+            if (_wvc_file.file == nullptr) {
+                _throw_error("Failed to open " + wvc_filename);
+            }
+            _wvc_file.buffer.reserve(write_buffer_size);
+        }
+
+        _wpc = WavpackOpenFileOutput(write_block, &_wv_file,
+                                     wvc ? &_wvc_file : nullptr);
+        if (_wpc == nullptr) {
+            _throw_error("WavpackOpenFileOutput failed");
+        }
+        if (!WavpackSetConfiguration64(static_cast<WavpackContext *>(_wpc),
+                                       &config, total_frames, nullptr)) {
+            _throw_error("WavpackSetConfiguration64 failed");
+        }
+        if (!options.file_extension.empty()) {
+            WavpackSetFileInformation(
+                static_cast<WavpackContext *>(_wpc),
+                const_cast<char *>(options.file_extension.c_str()),
+                options.file_format);
+        }
+        if (!WavpackPackInit(static_cast<WavpackContext *>(_wpc))) {
+            _throw_error("WavpackPackInit failed");
+        }
+    };
+
+    auto GetNumChannels() { return _channels; };
+    auto GetBitsPerSample() { return _bits_per_sample; };
+    auto IsFloat() { return _is_float; };
+    auto GetNumSamples64() { return _written; };
+    auto IsOpen() { return _wpc != nullptr; };
+
+    // The encoded stream when encoding into memory, after CloseFile()
+    std::vector<unsigned char> TakeBuffer() {
+        if (_wpc != nullptr || !_wv_file.in_memory) {
+            throw std::runtime_error("The stream isn't closed in memory");
+        }
+        return std::move(_wv_file.buffer);
+    };
+
+    // Store the bytes of the original file around the audio data, i.e. the
+    // header before any sample is packed, and the trailer after all of them
+    void AddWrapper(const void *data, size_t size) {
+        if (_wpc == nullptr) {
+            throw std::runtime_error("The file is already closed");
+        }
+        if (size == 0) {
+            return;
+        }
+        auto *wpc = static_cast<WavpackContext *>(_wpc);
+        // Same as the wavpack command, the trailer goes after the last block
+        // of samples
+        if (_written > 0 && !WavpackFlushSamples(wpc)) {
+            _throw_error("WavpackFlushSamples failed");
+        }
+        if (!WavpackAddWrapper(wpc, const_cast<void *>(data),
+                               static_cast<uint32_t>(size))) {
+            _throw_error("WavpackAddWrapper failed");
+        }
+    };
+
+    void SetMD5Sum(const unsigned char digest[16]) {
+        std::memcpy(_digest, digest, 16);
+        _has_digest = true;
+    };
+
+    // Encode "frames" samples per channel of "type" interleaved in "data".
+    // This doesn't touch any Python object.
+    void PackSamples(const void *data, SampleType type, int64_t frames) {
+        if (_wpc == nullptr) {
+            throw std::runtime_error("The file is already closed");
+        }
+        ScopedTimer timer(perf_counters.pack_ns);
+        auto item_size = sample_type_size(type);
+        auto *in = static_cast<const uint8_t *>(data);
+        _scratch.resize(convert_block * _channels);
+        for (int64_t done = 0; done < frames;) {
+            auto n = std::min(frames - done, convert_block);
+            auto count = static_cast<size_t>(n) * _channels;
+            convert_input(in + done * _channels * item_size, type,
+                          _scratch.data(), count, _is_float,
+                          _bits_per_sample);
+            if (_md5) {
+                md5_update_samples(_md5_context, _scratch.data(), count,
+                                   _bytes_per_sample, _qmode);
+            }
+            if (!WavpackPackSamples(static_cast<WavpackContext *>(_wpc),
+                                    _scratch.data(),
+                                    static_cast<uint32_t>(n))) {
+                _throw_error("WavpackPackSamples failed");
+            }
+            done += n;
+            _written += n;
+        }
+        add_counter(perf_counters.samples_encoded, frames);
+    };
+
+    auto FlushSamples() {
+        if (_wpc == nullptr) {
+            throw std::runtime_error("The file is already closed");
+        }
+        if (!WavpackFlushSamples(static_cast<WavpackContext *>(_wpc))) {
+            _throw_error("WavpackFlushSamples failed");
+        }
+    };
+
+    auto CloseFile() {
+        if (_wpc == nullptr) {
+            return;
+        }
+        auto *wpc = static_cast<WavpackContext *>(_wpc);
+        // Same as the wavpack command, the checksum is stored after the
+        // last block of samples is flushed
+        if (!WavpackFlushSamples(wpc)) {
+            _throw_error("WavpackFlushSamples failed");
+        }
+        if (_md5 && !_has_digest) {
+            _md5_context.final(_digest);
+            _has_digest = true;
+        }
+        if (_store_md5 && _has_digest) {
+            WavpackStoreMD5Sum(wpc, _digest);
+            if (!WavpackFlushSamples(wpc)) {
+                _throw_error("WavpackFlushSamples failed");
+            }
+        }
+        if (!flush_block_buffer(&_wv_file) ||
+            !flush_block_buffer(&_wvc_file)) {
+            _throw_error("Failed to write");
+        }
+        // Same as the wavpack command, the number of samples in the header
+        // is fixed if it wasn't known in advance.
+        if (_total_samples != _written) {
+            _rewrite_first_block(_wv_file);
+            _rewrite_first_block(_wvc_file);
+        }
+        _close_streams();
+    };
+
+    ~WavpackWrite() {
+        try {
+            CloseFile();
+        } catch (...) {
+        }
+    };
+    WavpackWrite(const WavpackWrite &) = delete;
+    WavpackWrite &operator=(const WavpackWrite &) = delete;
+};
+
+
+static SampleType check_input_array(const InputArray &array, int channels) {
+    auto ok = array.ndim() == 2
+                  ? array.shape(1) == static_cast<size_t>(channels)
+                  : array.ndim() == 1 && channels == 1;
+    if (!ok) {
+        throw std::invalid_argument(
+            _format("The array must have the shape of (frames, %d)",
+                    channels));
+    }
+    return sample_type_of(array.dtype());
+};
+
+
+auto wavpack_write_samples(WavpackWrite &self, InputArray array) {
+    auto type = check_input_array(array, self.GetNumChannels());
+    if (self.IsFloat() &&
+        (type == SampleType::Int16 || type == SampleType::Int32)) {
+        throw std::invalid_argument(
+            "Float files can only be written from float arrays");
+    }
+    nb::gil_scoped_release release;
+    self.PackSamples(array.data(), type, static_cast<int64_t>(array.shape(0)));
+};
+
+
+// A contiguous array of samples to be encoded, which can be read without the
+// GIL
+struct EncodeSource {
+    const void *data;
+    SampleType type;
+    int64_t frames;
+    int channels;
+};
+
+// int32 arrays need bits_per_sample (or is_float), because it can't be told
+// from the dtype how many bits of them are used.
+static EncodeSource get_encode_source(const InputArray &array,
+                                      const EncodeOptions &options) {
+    if (array.ndim() != 1 && array.ndim() != 2) {
+        throw std::invalid_argument(
+            "The array must have the shape of (frames, channels)");
+    }
+    EncodeSource source;
+    source.channels =
+        array.ndim() == 2 ? static_cast<int>(array.shape(1)) : 1;
+    source.type = check_input_array(array, source.channels);
+    if (source.type == SampleType::Int32 && options.bits_per_sample == 0 &&
+        !options.is_float) {
+        throw std::invalid_argument(
+            "bits_per_sample is required to write int32 arrays");
+    }
+    source.data = array.data();
+    source.frames = static_cast<int64_t>(array.shape(0));
+    return source;
+};
+
+// If bits_per_sample is 0, it's inferred from the dtype: 16 for int16 and
+// 32-bit float for float32/float64 (or int32 with is_float).
+static EncodeOptions infer_encode_options(EncodeOptions options,
+                                          SampleType type) {
+    if (options.bits_per_sample == 0) {
+        if (type == SampleType::Int16) {
+            options.bits_per_sample = 16;
+        } else {
+            options.bits_per_sample = 32;
+            options.is_float = options.is_float ||
+                               type == SampleType::Float32 ||
+                               type == SampleType::Float64;
+        }
+    }
+    return options;
+};
+
+// Encode the whole "source" into "outfilename". This doesn't touch any Python
+// object.
+static void write_file(const char *outfilename, const EncodeSource &source,
+                       uint32_t sample_rate, const EncodeOptions &options) {
+    auto opts = infer_encode_options(options, source.type);
+    WavpackWrite writer(outfilename, sample_rate, source.channels,
+                        source.frames, opts);
+    writer.PackSamples(source.data, source.type, source.frames);
+    writer.CloseFile();
+};
+
+// Encode the whole "source" into a complete WavPack stream in memory. This
+// doesn't touch any Python object.
+static std::vector<unsigned char> encode_to_memory(
+    const EncodeSource &source, uint32_t sample_rate,
+    const EncodeOptions &options) {
+    auto opts = infer_encode_options(options, source.type);
+    WavpackWrite writer(nullptr, sample_rate, source.channels, source.frames,
+                        opts);
+    writer.PackSamples(source.data, source.type, source.frames);
+    writer.CloseFile();
+    return writer.TakeBuffer();
+};
+
+// Re-encode the WavPack file "infilename" into "outfilename" with "options",
+// keeping the format of the samples. This doesn't touch any Python object.
+static void rewrite_file(const char *infilename, const char *outfilename,
+                         const EncodeOptions &options) {
+    auto wpcc = WavpackRead(infilename, OPEN_WVC, 0);
+    check_readable(wpcc);
+    auto format = get_sample_format(wpcc);
+    auto opts = options;
+    opts.bits_per_sample = format.is_float ? 32 : wpcc.GetBitsPerSample();
+    opts.is_float = format.is_float;
+    if (opts.channel_mask == 0) {
+        opts.channel_mask = wpcc.GetChannelMask();
+    }
+    auto channels = wpcc.GetNumChannels();
+
+    // Into temporary files, so that a failure doesn't leave a truncated
+    // "outfilename" (or a stale one in place of it)
+    auto temp = temp_filename(outfilename);
+    try {
+        WavpackWrite writer(temp.c_str(), wpcc.GetNativeSampleRate(),
+                            channels, wpcc.GetNumSamples64(), opts);
+
+        // The raw int32 values (or float bit patterns) are passed through
+        std::vector<int32_t> buffer(convert_block * channels);
+        while (true) {
+            auto n = wpcc.UnpackSamples(buffer.data(),
+                                        static_cast<uint32_t>(convert_block));
+            if (n == 0) {
+                break;
+            }
+            writer.PackSamples(buffer.data(), SampleType::Int32, n);
+        }
+        if (wpcc.GetNumErrors() > 0) {
+            throw std::runtime_error(
+                _format("%d errors were found while decoding",
+                        wpcc.GetNumErrors()));
+        }
+        writer.CloseFile();
+    } catch (...) {
+        std::remove(temp.c_str());
+        std::remove((temp + "c").c_str());
+        throw;
+    }
+    if (opts.wvc) {
+        try {
+            rename_temp_file(temp + "c",
+                             (std::string(outfilename) + "c").c_str());
+        } catch (...) {
+            std::remove(temp.c_str());
+            throw;
+        }
+    }
+    rename_temp_file(temp, outfilename);
+};
+
+
+auto wavpack_write(const char *outfilename, InputArray array,
+                   uint32_t sample_rate, int bits_per_sample, bool is_float,
+                   const std::string &mode, int extra, double bitrate,
+                   bool wvc, bool md5, int channel_mask, int worker_threads) {
+    auto options =
+        make_encode_options(bits_per_sample, is_float, mode, extra, bitrate,
+                            wvc, md5, channel_mask, worker_threads);
+    auto source = get_encode_source(array, options);
+
+    nb::gil_scoped_release release;
+    write_file(outfilename, source, sample_rate, options);
+};
+
+
+// Encode many arrays, or re-encode many WavPack files given by paths, on a
+// pool of native threads.
+auto wavpack_write_many(const std::vector<std::string> &outfilenames,
+                        nb::handle inputs, uint32_t sample_rate,
+                        int bits_per_sample, bool is_float,
+                        const std::string &mode, int extra, double bitrate,
+                        bool wvc, bool md5, int channel_mask,
+                        int worker_threads, int num_threads) {
+    auto options =
+        make_encode_options(bits_per_sample, is_float, mode, extra, bitrate,
+                            wvc, md5, channel_mask, worker_threads);
+
+    // The arrays are kept referenced here until the GIL is reacquired
+    std::vector<InputArray> arrays;
+    std::vector<std::string> infilenames;
+    std::vector<EncodeSource> sources;
+    for (auto item : inputs) {
+        if (nb::isinstance<nb::str>(item)) {
+            infilenames.push_back(nb::cast<std::string>(item));
+            sources.push_back(EncodeSource{nullptr, SampleType::Int32, 0, 0});
+        } else {
+            if (sample_rate == 0) {
+                throw std::invalid_argument(
+                    "sample_rate is required to write arrays");
+            }
+            arrays.push_back(nb::cast<InputArray>(item));
+            infilenames.emplace_back();
+            sources.push_back(get_encode_source(arrays.back(), options));
+        }
+    }
+    if (sources.size() != outfilenames.size()) {
+        throw std::invalid_argument(
+            "The numbers of outfilenames and inputs must be the same");
+    }
+
+    nb::gil_scoped_release release;
+    parallel_for(sources.size(), num_threads, [&](size_t i) {
+        try {
+            if (sources[i].data == nullptr) {
+                rewrite_file(infilenames[i].c_str(), outfilenames[i].c_str(),
+                             options);
+            } else {
+                write_file(outfilenames[i].c_str(), sources[i], sample_rate,
+                           options);
+            }
+        } catch (const std::exception &e) {
+            throw std::runtime_error(
+                _format("%s: %s", outfilenames[i].c_str(), e.what()));
+        }
+    });
+};
+
+
+// A FIFO of at most "capacity" items between the stages of a pipeline of
+// threads. close() wakes up both sides: push() fails after it, and pop()
+// fails once the remaining items are taken.
+template <typename T>
+struct BoundedQueue {
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    std::deque<T> _items;
+    size_t _capacity;
+    bool _closed = false;
+
+    explicit BoundedQueue(size_t capacity)
+        : _capacity(std::max<size_t>(capacity, 1)) {};
+
+    bool push(T &&item) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cond.wait(lock, [&] { return _closed || _items.size() < _capacity; });
+        if (_closed) {
+            return false;
+        }
+        _items.push_back(std::move(item));
+        _cond.notify_all();
+        return true;
+    };
+
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cond.wait(lock, [&] { return _closed || !_items.empty(); });
+        if (_items.empty()) {
+            return false;
+        }
+        item = std::move(_items.front());
+        _items.pop_front();
+        _cond.notify_all();
+        return true;
+    };
+
+    void close() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _closed = true;
+        _cond.notify_all();
+    };
+};
+
+
+// The layout of the samples in a WAV, W64 or CAF file
+struct PcmFormat {
+    unsigned char file_format = WP_FORMAT_WAV;
+    std::string extension;
+    int channels = 0;
+    uint32_t sample_rate = 0;
+    int bits_per_sample = 0;
+    int bytes_per_sample = 0;
+    bool is_float = false;
+    bool big_endian = false;
+    // 8-bit samples are unsigned in WAV files but signed in CAF files
+    bool signed_bytes = false;
+    int channel_mask = 0;
+    // The size of the audio data in bytes, or -1 if it lasts until the end of
+    // the file
+    int64_t data_size = -1;
+};
+
+static uint64_t get_be(const unsigned char *in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+};
+
+// Read "size" more bytes of the header of "file" into "header", and return
+// the position of them in "header"
+static size_t read_header(FILE *file, const char *filename, size_t size,
+                          std::vector<unsigned char> &header) {
+    auto pos = header.size();
+    header.resize(pos + size);
+    if (size > 0 && fread(header.data() + pos, 1, size, file) != size) {
+        throw std::runtime_error(
+            _format("%s: The header is truncated", filename));
+    }
+    return pos;
+};
+
+static void check_pcm_format(PcmFormat &format, const char *filename) {
+    auto bytes = format.bytes_per_sample;
+    if (format.channels <= 0 || format.channels > WAVPACK_MAX_CHANS ||
+        format.sample_rate == 0 || bytes < 1 || bytes > 4 ||
+        (format.is_float && bytes != 4)) {
+        throw std::invalid_argument(
+            _format("%s: Unsupported format (%d channels, %u Hz, %d bytes "
+                    "per sample%s)",
+                    filename, format.channels, format.sample_rate, bytes,
+                    format.is_float ? ", float" : ""));
+    }
+    // The number of valid bits is only kept if it fits in the container
+    if (format.is_float) {
+        format.bits_per_sample = 32;
+    } else if (format.bits_per_sample <= 0 ||
+               (format.bits_per_sample + 7) / 8 != bytes) {
+        format.bits_per_sample = bytes * 8;
+    }
+};
+
+// The "fmt " chunk of WAV and W64 files
+static void parse_wav_fmt(const unsigned char *p, size_t size,
+                          PcmFormat &format, const char *filename) {
+    if (size < 16) {
+        throw std::runtime_error(
+            _format("%s: The fmt chunk is too short", filename));
+    }
+    auto tag = get_le(p, 2);
+    format.channels = static_cast<int>(get_le(p + 2, 2));
+    format.sample_rate = static_cast<uint32_t>(get_le(p + 4, 4));
+    auto block_align = static_cast<int>(get_le(p + 12, 2));
+    format.bits_per_sample = static_cast<int>(get_le(p + 14, 2));
+    if (tag == 0xFFFE && size >= 40) {
+        // WAVE_FORMAT_EXTENSIBLE
+        if (get_le(p + 18, 2) != 0) {
+            format.bits_per_sample = static_cast<int>(get_le(p + 18, 2));
+        }
+        format.channel_mask = static_cast<int>(get_le(p + 20, 4));
+        tag = get_le(p + 24, 2);
+    }
+    if (tag != 1 && tag != 3) {
+        throw std::invalid_argument(
+            _format("%s: Only PCM and IEEE float are supported, but the "
+                    "format tag is 0x%x",
+                    filename, static_cast<unsigned>(tag)));
+    }
+    format.is_float = tag == 3;
+    format.bytes_per_sample =
+        format.channels > 0 ? block_align / format.channels : 0;
+    if (format.bytes_per_sample * format.channels != block_align) {
+        throw std::invalid_argument(
+            _format("%s: Invalid block align %d for %d channels", filename,
+                    block_align, format.channels));
+    }
+};
+
+// RIFF/RF64 WAVE
+static void parse_wav_header(FILE *file, const char *filename,
+                             std::vector<unsigned char> &header,
+                             PcmFormat &format) {
+    bool rf64 = std::memcmp(header.data(), "RF64", 4) == 0;
+    read_header(file, filename, 8, header);
+    if (std::memcmp(header.data() + 8, "WAVE", 4) != 0) {
+        throw std::runtime_error(_format("%s: Not a WAVE file", filename));
+    }
+    int64_t ds64_data_size = -1;
+    bool has_fmt = false;
+    while (true) {
+        auto pos = read_header(file, filename, 8, header);
+        auto size = get_le(header.data() + pos + 4, 4);
+        if (std::memcmp(header.data() + pos, "data", 4) == 0) {
+            if (rf64 && size == 0xFFFFFFFF) {
+                format.data_size = ds64_data_size;
+            } else if (size != 0 && size != 0xFFFFFFFF) {
+                // Streaming writers leave 0 or -1 here
+                format.data_size = static_cast<int64_t>(size);
+            }
+            break;
+        }
+        // Chunks are padded to even sizes
+        auto body = read_header(file, filename, size + (size & 1), header);
+        if (std::memcmp(header.data() + pos, "fmt ", 4) == 0) {
+            parse_wav_fmt(header.data() + body, size, format, filename);
+            has_fmt = true;
+        } else if (std::memcmp(header.data() + pos, "ds64", 4) == 0 &&
+                   size >= 16) {
+            ds64_data_size =
+                static_cast<int64_t>(get_le(header.data() + body + 8, 8));
+        }
+    }
+    if (!has_fmt) {
+        throw std::runtime_error(
+            _format("%s: No fmt chunk before the data", filename));
+    }
+};
+
+// Sony Wave64, whose chunks are identified by GUIDs and 8-byte aligned
+static void parse_w64_header(FILE *file, const char *filename,
+                             std::vector<unsigned char> &header,
+                             PcmFormat &format) {
+    static const unsigned char guid_tail[12] = {0xF3, 0xAC, 0xD3, 0x11,
+                                                0x8C, 0xD1, 0x00, 0xC0,
+                                                0x4F, 0x8E, 0xDB, 0x8A};
+    read_header(file, filename, 36, header);
+    if (std::memcmp(header.data() + 24, "wave", 4) != 0 ||
+        std::memcmp(header.data() + 28, guid_tail, 12) != 0) {
+        throw std::runtime_error(_format("%s: Not a W64 file", filename));
+    }
+    format.file_format = WP_FORMAT_W64;
+    format.extension = "w64";
+    bool has_fmt = false;
+    while (true) {
+        auto pos = read_header(file, filename, 24, header);
+        auto *id = header.data() + pos;
+        auto size = get_le(id + 16, 8);
+        if (size < 24) {
+            throw std::runtime_error(
+                _format("%s: Invalid chunk size", filename));
+        }
+        size -= 24;
+        if (std::memcmp(id, "data", 4) == 0 &&
+            std::memcmp(id + 4, guid_tail, 12) == 0) {
+            format.data_size = static_cast<int64_t>(size);
+            break;
+        }
+        bool is_fmt = std::memcmp(id, "fmt ", 4) == 0 &&
+                      std::memcmp(id + 4, guid_tail, 12) == 0;
+        auto body = read_header(file, filename, (size + 7) & ~7ull, header);
+        if (is_fmt) {
+            parse_wav_fmt(header.data() + body, size, format, filename);
+            has_fmt = true;
+        }
+    }
+    if (!has_fmt) {
+        throw std::runtime_error(
+            _format("%s: No fmt chunk before the data", filename));
+    }
+};
+
+// Core Audio Format with linear PCM, which is big-endian by default
+static void parse_caf_header(FILE *file, const char *filename,
+                             std::vector<unsigned char> &header,
+                             PcmFormat &format) {
+    read_header(file, filename, 4, header);
+    format.file_format = WP_FORMAT_CAF;
+    format.extension = "caf";
+    format.signed_bytes = true;
+    bool has_desc = false;
+    while (true) {
+        auto pos = read_header(file, filename, 12, header);
+        auto size = static_cast<int64_t>(get_be(header.data() + pos + 4, 8));
+        if (std::memcmp(header.data() + pos, "data", 4) == 0) {
+            // The edit count precedes the audio data
+            read_header(file, filename, 4, header);
+            format.data_size = size < 4 ? -1 : size - 4;
+            break;
+        }
+        if (size < 0) {
+            throw std::runtime_error(
+                _format("%s: Invalid chunk size", filename));
+        }
+        auto body = read_header(file, filename, static_cast<size_t>(size),
+                                header);
+        if (std::memcmp(header.data() + pos, "desc", 4) == 0 && size >= 32) {
+            auto *p = header.data() + body;
+            auto bits = get_be(p, 8);
+            double rate;
+            std::memcpy(&rate, &bits, sizeof(rate));
+            auto flags = get_be(p + 12, 4);
+            auto bytes_per_packet = static_cast<int>(get_be(p + 16, 4));
+            auto frames_per_packet = get_be(p + 20, 4);
+            format.channels = static_cast<int>(get_be(p + 24, 4));
+            format.bits_per_sample = static_cast<int>(get_be(p + 28, 4));
+            if (std::memcmp(p + 8, "lpcm", 4) != 0 ||
+                frames_per_packet != 1 || format.channels <= 0 ||
+                rate != std::floor(rate) || rate <= 0) {
+                throw std::invalid_argument(
+                    _format("%s: Only linear PCM is supported", filename));
+            }
+            format.sample_rate = static_cast<uint32_t>(rate);
+            format.is_float = flags & 1;
+            format.big_endian = !(flags & 2);
+            format.bytes_per_sample = bytes_per_packet / format.channels;
+            has_desc = true;
+        }
+    }
+    if (!has_desc) {
+        throw std::runtime_error(
+            _format("%s: No desc chunk before the data", filename));
+    }
+};
+
+// Read the header of "file" up to the beginning of the audio data into
+// "header", which is stored as the wrapper
+static PcmFormat parse_pcm_header(FILE *file, const char *filename,
+                                  std::vector<unsigned char> &header) {
+    PcmFormat format;
+    read_header(file, filename, 4, header);
+    if (std::memcmp(header.data(), "RIFF", 4) == 0 ||
+        std::memcmp(header.data(), "RF64", 4) == 0) {
+        parse_wav_header(file, filename, header, format);
+    } else if (std::memcmp(header.data(), "riff", 4) == 0) {
+        parse_w64_header(file, filename, header, format);
+    } else if (std::memcmp(header.data(), "caff", 4) == 0) {
+        parse_caf_header(file, filename, header, format);
+    } else {
+        throw std::invalid_argument(
+            _format("%s: Only WAV, W64 and CAF files are supported",
+                    filename));
+    }
+    check_pcm_format(format, filename);
+    return format;
+};
+
+// Convert the samples as stored in the file into the int32 values for
+// WavpackPackSamples(), i.e. sign-extended integers or float bit patterns
+static void pcm_to_samples(const unsigned char *src, int32_t *dst,
+                           size_t count, int bytes, bool big_endian,
+                           bool unsigned_bytes) {
+    auto shift = 32 - 8 * bytes;
+    for (size_t i = 0; i < count; i++, src += bytes) {
+        uint32_t value = 0;
+        for (int j = 0; j < bytes; j++) {
+            value = (value << 8) | src[big_endian ? j : bytes - 1 - j];
+        }
+        if (unsigned_bytes) {
+            dst[i] = static_cast<int32_t>(value) - 128;
+        } else {
+            dst[i] = static_cast<int32_t>(value << shift) >> shift;
+        }
+    }
+};
+
+// The inverse of pcm_to_samples()
+static void samples_to_pcm(const int32_t *src, unsigned char *dst,
+                           size_t count, int bytes, bool big_endian,
+                           bool unsigned_bytes) {
+    for (size_t i = 0; i < count; i++, dst += bytes) {
+        auto value = static_cast<uint32_t>(src[i]);
+        if (unsigned_bytes) {
+            value += 128;
+        }
+        for (int j = 0; j < bytes; j++) {
+            dst[big_endian ? bytes - 1 - j : j] =
+                static_cast<unsigned char>(value >> (8 * j));
+        }
+    }
+};
+
+// A canonical WAV header for WavPack files without a stored one, e.g. those
+// created with QMODE_NO_STORE_WRAPPER
+static std::vector<unsigned char> make_wav_header(int channels,
+                                                  uint32_t sample_rate,
+                                                  int bits_per_sample,
+                                                  int bytes_per_sample,
+                                                  bool is_float,
+                                                  int channel_mask,
+                                                  int64_t frames) {
+    bool extensible = channels > 2 || bits_per_sample != bytes_per_sample * 8;
+    auto block_align = bytes_per_sample * channels;
+    auto data_size = std::min<uint64_t>(
+        static_cast<uint64_t>(std::max<int64_t>(frames, 0)) * block_align,
+        0xFFFFFFFF - 36 - 40);
+    std::vector<unsigned char> out = {'R', 'I', 'F', 'F'};
+    put_le(out, data_size + (extensible ? 60 : 36) + (data_size & 1), 4);
+    out.insert(out.end(), {'W', 'A', 'V', 'E', 'f', 'm', 't', ' '});
+    put_le(out, extensible ? 40 : 16, 4);
+    put_le(out, extensible ? 0xFFFE : (is_float ? 3 : 1), 2);
+    put_le(out, channels, 2);
+    put_le(out, sample_rate, 4);
+    put_le(out, static_cast<uint64_t>(sample_rate) * block_align, 4);
+    put_le(out, block_align, 2);
+    put_le(out, bytes_per_sample * 8, 2);
+    if (extensible) {
+        put_le(out, 22, 2);
+        put_le(out, bits_per_sample, 2);
+        put_le(out, channel_mask, 4);
+        // KSDATAFORMAT_SUBTYPE_PCM or KSDATAFORMAT_SUBTYPE_IEEE_FLOAT
+        put_le(out, is_float ? 3 : 1, 2);
+        out.insert(out.end(), {0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00,
+                               0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71});
+    }
+    out.insert(out.end(), {'d', 'a', 't', 'a'});
+    put_le(out, data_size, 4);
+    return out;
+};
+
+
+// Encode a WAV, W64 or CAF file into "outfilename" with the header and the
+// trailer of the file stored as the wrapper, so that decompress_file()
+// restores the file byte for byte. A reader thread reads and converts
+// "chunk_frames" frames at a time, up to "prefetch" chunks ahead of the
+// encoder, so the memory doesn't depend on the size of the file. This
+// doesn't touch any Python object.
+static void compress_file(const char *infilename, const char *outfilename,
+                          const EncodeOptions &options, int64_t chunk_frames,
+                          int prefetch) {
+    if (chunk_frames <= 0) {
+        throw std::invalid_argument("chunk_frames must be positive");
+    }
+    std::unique_ptr<FILE, int (*)(FILE *)> file(fopen(infilename, "rb"),
+                                               fclose);
+    if (!file) {
+        throw std::runtime_error(_format("Failed to open %s", infilename));
+    }
+    std::vector<unsigned char> header;
+    auto format = parse_pcm_header(file.get(), infilename, header);
+    auto block_align =
+        static_cast<int64_t>(format.bytes_per_sample) * format.channels;
+
+    auto opts = options;
+    opts.bits_per_sample = format.bits_per_sample;
+    opts.is_float = format.is_float;
+    if (opts.channel_mask == 0) {
+        opts.channel_mask = format.channel_mask;
+    }
+    opts.qmode = (format.big_endian ? QMODE_BIG_ENDIAN : 0) |
+                 (format.bytes_per_sample == 1 && format.signed_bytes
+                      ? QMODE_SIGNED_BYTES
+                      : 0);
+    opts.file_extension = format.extension;
+    opts.file_format = format.file_format;
+    // The checksum is computed from the bytes in the file by the reader,
+    // but CONFIG_MD5_CHECKSUM is still needed to store it
+    opts.md5_supplied = true;
+    WavpackWrite writer(outfilename, format.sample_rate, format.channels,
+                        format.data_size < 0 ? -1
+                                             : format.data_size / block_align,
+                        opts);
+    writer.AddWrapper(header.data(), header.size());
+
+    BoundedQueue<std::vector<int32_t>> queue(prefetch);
+    MD5Context md5;
+    std::exception_ptr error;
+    std::thread reader([&]() {
+        try {
+            auto remaining = format.data_size;
+            std::vector<unsigned char> raw(chunk_frames * block_align);
+            while (remaining != 0) {
+                auto size = static_cast<int64_t>(raw.size());
+                if (remaining > 0) {
+                    size = std::min(size, remaining);
+                }
+                auto n = fread(raw.data(), 1, static_cast<size_t>(size),
+                               file.get());
+                if (n % block_align != 0) {
+                    throw std::runtime_error(
+                        "The audio data ends in the middle of a frame");
+                }
+                if (n == 0) {
+                    break;
+                }
+                add_counter(perf_counters.bytes_read, n);
+                if (options.md5) {
+                    md5.update(raw.data(), n);
+                }
+                std::vector<int32_t> samples(n / format.bytes_per_sample);
+                pcm_to_samples(raw.data(), samples.data(), samples.size(),
+                               format.bytes_per_sample, format.big_endian,
+                               format.bytes_per_sample == 1 &&
+                                   !format.signed_bytes);
+                if (!queue.push(std::move(samples))) {
+                    break;
+                }
+                if (remaining > 0) {
+                    remaining -= static_cast<int64_t>(n);
+                }
+            }
+            if (ferror(file.get())) {
+                throw std::runtime_error(
+                    _format("Failed to read %s", infilename));
+            }
+        } catch (...) {
+            error = std::current_exception();
+        }
+        queue.close();
+    });
+
+    try {
+        std::vector<int32_t> samples;
+        while (queue.pop(samples)) {
+            writer.PackSamples(samples.data(), SampleType::Int32,
+                               static_cast<int64_t>(samples.size()) /
+                                   format.channels);
+        }
+    } catch (...) {
+        queue.close();
+        reader.join();
+        throw;
+    }
+    reader.join();
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    // Everything after the audio data, e.g. the pad byte and LIST chunks
+    std::vector<unsigned char> trailer;
+    unsigned char buffer[1 << 16];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file.get())) > 0) {
+        trailer.insert(trailer.end(), buffer, buffer + n);
+    }
+    writer.AddWrapper(trailer.data(), trailer.size());
+    if (options.md5) {
+        unsigned char digest[16];
+        md5.final(digest);
+        writer.SetMD5Sum(digest);
+    }
+    writer.CloseFile();
+};
+
+
+// Restore the original file of a WavPack file, i.e. the stored header, the
+// samples in the original format and the stored trailer. A writer thread
+// writes up to "prefetch" chunks behind the decoder. If "md5" is true and the
+// file has the checksum, it's compared with the one of the written samples.
+// This doesn't touch any Python object.
+static void decompress_file(const char *infilename, const char *outfilename,
+                            bool md5, int64_t chunk_frames, int prefetch) {
+    if (chunk_frames <= 0) {
+        throw std::invalid_argument("chunk_frames must be positive");
+    }
+    auto wpcc = WavpackRead(infilename, OPEN_WVC | OPEN_WRAPPER, 0);
+    check_readable(wpcc);
+    auto file_format = wpcc.GetFileFormat();
+    if (file_format == WP_FORMAT_DFF || file_format == WP_FORMAT_DSF) {
+        throw std::invalid_argument("DSD audio isn't supported");
+    }
+    auto qmode = wpcc.GetQualifyMode();
+    auto channels = wpcc.GetNumChannels();
+    auto bytes = wpcc.GetBytesPerSample();
+    auto big_endian = (qmode & QMODE_BIG_ENDIAN) != 0;
+    auto unsigned_bytes = bytes == 1 && !(qmode & QMODE_SIGNED_BYTES);
+
+    std::vector<unsigned char> header;
+    bool has_wrapper = wpcc.GetWrapperBytes() > 0;
+    if (has_wrapper) {
+        header.assign(wpcc.GetWrapperData(),
+                      wpcc.GetWrapperData() + wpcc.GetWrapperBytes());
+        wpcc.FreeWrapper();
+    } else {
+        header = make_wav_header(channels, wpcc.GetNativeSampleRate(),
+                                 wpcc.GetBitsPerSample(), bytes,
+                                 (wpcc.GetMode() & MODE_FLOAT) != 0,
+                                 wpcc.GetChannelMask(),
+                                 wpcc.GetNumSamples64());
+    }
+
+    std::unique_ptr<FILE, int (*)(FILE *)> file(fopen(outfilename, "wb"),
+                                               fclose);
+    if (!file) {
+        throw std::runtime_error(_format("Failed to open %s", outfilename));
+    }
+    BoundedQueue<std::vector<unsigned char>> queue(prefetch);
+    std::exception_ptr error;
+    std::thread writer([&]() {
+        try {
+            std::vector<unsigned char> data;
+            while (queue.pop(data)) {
+                uint32_t bcount;
+                if (!DoWriteFile(file.get(), data.data(),
+                                 static_cast<uint32_t>(data.size()),
+                                 &bcount) ||
+                    bcount != data.size()) {
+                    throw std::runtime_error(
+                        _format("Failed to write %s", outfilename));
+                }
+            }
+        } catch (...) {
+            error = std::current_exception();
+        }
+        queue.close();
+    });
+
+    MD5Context md5_context;
+    try {
+        queue.push(std::move(header));
+        std::vector<int32_t> samples(chunk_frames * channels);
+        uint64_t data_size = 0;
+        while (true) {
+            auto n = wpcc.UnpackSamples(samples.data(),
+                                        static_cast<uint32_t>(chunk_frames));
+            if (n == 0) {
+                break;
+            }
+            std::vector<unsigned char> data(static_cast<size_t>(n) *
+                                            channels * bytes);
+            samples_to_pcm(samples.data(), data.data(),
+                           static_cast<size_t>(n) * channels, bytes,
+                           big_endian, unsigned_bytes);
+            if (md5) {
+                md5_context.update(data.data(), data.size());
+            }
+            data_size += data.size();
+            if (!queue.push(std::move(data))) {
+                break;
+            }
+        }
+        // The pad byte of an odd-sized data chunk counted by
+        // make_wav_header(). A stored wrapper has it in the trailer.
+        if (!has_wrapper && (data_size & 1)) {
+            queue.push(std::vector<unsigned char>(1, 0));
+        }
+        if (wpcc.GetNumErrors() > 0) {
+            throw std::runtime_error(
+                _format("%d errors were found while decoding",
+                        wpcc.GetNumErrors()));
+        }
+        // The trailer is read with the last block, or found by seeking
+        if (wpcc.GetWrapperBytes() == 0) {
+            wpcc.SeekTrailingWrapper();
+        }
+        if (wpcc.GetWrapperBytes() > 0) {
+            queue.push(std::vector<unsigned char>(
+                wpcc.GetWrapperData(),
+                wpcc.GetWrapperData() + wpcc.GetWrapperBytes()));
+            wpcc.FreeWrapper();
+        }
+    } catch (...) {
+        queue.close();
+        writer.join();
+        throw;
+    }
+    queue.close();
+    writer.join();
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    if (fclose(file.release()) != 0) {
+        throw std::runtime_error(_format("Failed to write %s", outfilename));
+    }
+
+    unsigned char stored[16];
+    if (md5 && wpcc.GetMd5sum(stored)) {
+        unsigned char digest[16];
+        md5_context.final(digest);
+        if (std::memcmp(stored, digest, 16) != 0) {
+            throw std::runtime_error(
+                _format("%s: The MD5 checksum doesn't match", infilename));
+        }
+    }
+};
+
+
+// Compress or decompress many files on a pool of native threads. Each file
+// uses its own reader or writer thread in addition.
+auto wavpack_compress_many(const std::vector<std::string> &infilenames,
+                           const std::vector<std::string> &outfilenames,
+                           const std::string &mode, int extra, double bitrate,
+                           bool wvc, bool md5, int worker_threads,
+                           int64_t chunk_frames, int prefetch,
+                           int num_threads) {
+    if (infilenames.size() != outfilenames.size()) {
+        throw std::invalid_argument(
+            "The numbers of infilenames and outfilenames must be the same");
+    }
+    // The format is taken from each input file
+    auto options = make_encode_options(16, false, mode, extra, bitrate, wvc,
+                                       md5, 0, worker_threads);
+
+    nb::gil_scoped_release release;
+    parallel_for(infilenames.size(), num_threads, [&](size_t i) {
+        try {
+            compress_file(infilenames[i].c_str(), outfilenames[i].c_str(),
+                          options, chunk_frames, prefetch);
+        } catch (const std::exception &e) {
+            throw std::runtime_error(
+                _format("%s: %s", infilenames[i].c_str(), e.what()));
+        }
+    });
+};
+
+auto wavpack_decompress_many(const std::vector<std::string> &infilenames,
+                             const std::vector<std::string> &outfilenames,
+                             bool md5, int64_t chunk_frames, int prefetch,
+                             int num_threads) {
+    if (infilenames.size() != outfilenames.size()) {
+        throw std::invalid_argument(
+            "The numbers of infilenames and outfilenames must be the same");
+    }
+
+    nb::gil_scoped_release release;
+    parallel_for(infilenames.size(), num_threads, [&](size_t i) {
+        try {
+            decompress_file(infilenames[i].c_str(), outfilenames[i].c_str(),
+                            md5, chunk_frames, prefetch);
+        } catch (const std::exception &e) {
+            throw std::runtime_error(
+                _format("%s: %s", infilenames[i].c_str(), e.what()));
+        }
+    });
+};
+
+// The regular files directly in "dir" with one of "extensions" (lowercase
+// without the dot, matched case-insensitively), sorted by name
+static std::vector<std::filesystem::path>
+list_files(const std::string &dir, const std::vector<std::string> &extensions) {
+    std::error_code ec;
+    std::vector<std::filesystem::path> paths;
+    for (auto &entry : std::filesystem::directory_iterator(dir, ec)) {
+        auto ext = entry.path().extension().string();
+        std::transform(ext.begin(), ext.end(), ext.begin(),
+                       [](unsigned char c) { return std::tolower(c); });
+        if (!entry.is_regular_file() || ext.empty() ||
+            std::find(extensions.begin(), extensions.end(), ext.substr(1)) ==
+                extensions.end()) {
+            continue;
+        }
+        paths.push_back(entry.path());
+    }
+    if (ec) {
+        throw std::runtime_error(_format("Failed to list %s: %s", dir.c_str(),
+                                         ec.message().c_str()));
+    }
+    std::sort(paths.begin(), paths.end());
+    return paths;
+};
+
+// Compress the WAV, W64 and CAF files in "indir" into "outdir" with the
+// extension replaced by ".wv". Returns the paths of the compressed files.
+auto wavpack_compress_dir(const std::string &indir, const std::string &outdir,
+                          const std::string &mode, int extra, double bitrate,
+                          bool wvc, bool md5, int worker_threads,
+                          int64_t chunk_frames, int prefetch,
+                          int num_threads) {
+    std::vector<std::string> infilenames, outfilenames;
+    {
+        nb::gil_scoped_release release;
+        std::filesystem::create_directories(outdir);
+        for (auto &path : list_files(indir, {"wav", "w64", "caf"})) {
+            infilenames.push_back(path.string());
+            auto out = std::filesystem::path(outdir) / path.filename();
+            outfilenames.push_back(out.replace_extension(".wv").string());
+        }
+    }
+    wavpack_compress_many(infilenames, outfilenames, mode, extra, bitrate,
+                          wvc, md5, worker_threads, chunk_frames, prefetch,
+                          num_threads);
+    return outfilenames;
+};
+
+// Decompress the WavPack files in "indir" into "outdir" with the extension
+// of the original file, e.g. ".caf". Returns the paths of the restored files.
+auto wavpack_decompress_dir(const std::string &indir,
+                            const std::string &outdir, bool md5,
+                            int64_t chunk_frames, int prefetch,
+                            int num_threads) {
+    nb::gil_scoped_release release;
+    std::filesystem::create_directories(outdir);
+    auto paths = list_files(indir, {"wv"});
+    std::vector<std::string> outfilenames(paths.size());
+    parallel_for(paths.size(), num_threads, [&](size_t i) {
+        auto infilename = paths[i].string();
+        try {
+            std::string extension;
+            {
+                auto wpcc = WavpackRead(infilename.c_str(), 0, 0);
+                check_readable(wpcc);
+                extension = wpcc.GetFileExtention();
+            }
+            auto out = std::filesystem::path(outdir) / paths[i].filename();
+            outfilenames[i] = out.replace_extension("." + extension).string();
+            decompress_file(infilename.c_str(), outfilenames[i].c_str(), md5,
+                            chunk_frames, prefetch);
+        } catch (const std::exception &e) {
+            throw std::runtime_error(
+                _format("%s: %s", infilename.c_str(), e.what()));
+        }
+    });
+    return outfilenames;
+};
+
+
+// A shard concatenates many WavPack streams ("clips") into one file, so
+// that a dataset of small clips needs one open() and one mmap instead of
+// one per clip. The layout is, all in little-endian,
+//
+//   "WVSH", version (u32), 8 reserved bytes
+//   the clips, each of which is a complete WavPack stream
+//   the index: for each clip, the length of the key (u32), the key, offset,
+//     length (u64), num_samples (i64), sample_rate and channels (u32)
+//   the offset of the index and the number of clips (u64), "WVSX",
+//     version (u32)
+//
+// The index can also be saved to a sidecar file, which is "WVSI",
+// version (u32), the number of clips (u64) and the index.
+struct ShardEntry {
+    std::string key;
+    int64_t offset;
+    int64_t length;
+    int64_t num_samples;
+    uint32_t sample_rate;
+    uint32_t channels;
+};
+
+static const size_t shard_header_size = 16;
+static const size_t shard_trailer_size = 24;
+
+static void put_shard_index(std::vector<unsigned char> &out,
+                            const std::vector<ShardEntry> &entries) {
+    for (auto &e : entries) {
+        put_le(out, e.key.size(), 4);
+        out.insert(out.end(), e.key.begin(), e.key.end());
+        put_le(out, e.offset, 8);
+        put_le(out, e.length, 8);
+        put_le(out, e.num_samples, 8);
+        put_le(out, e.sample_rate, 4);
+        put_le(out, e.channels, 4);
+    }
+};
+
+static std::vector<ShardEntry> get_shard_index(const unsigned char *data,
+                                               size_t size, uint64_t count) {
+    std::vector<ShardEntry> entries;
+    size_t pos = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        if (pos + 4 > size) {
+            throw std::runtime_error("The shard index is truncated");
+        }
+        auto key_size = static_cast<size_t>(get_le(data + pos, 4));
+        pos += 4;
+        if (pos + key_size + 32 > size) {
+            throw std::runtime_error("The shard index is truncated");
+        }
+        ShardEntry e;
+        e.key.assign(reinterpret_cast<const char *>(data + pos), key_size);
+        pos += key_size;
+        e.offset = static_cast<int64_t>(get_le(data + pos, 8));
+        e.length = static_cast<int64_t>(get_le(data + pos + 8, 8));
+        e.num_samples = static_cast<int64_t>(get_le(data + pos + 16, 8));
+        e.sample_rate = static_cast<uint32_t>(get_le(data + pos + 24, 4));
+        e.channels = static_cast<uint32_t>(get_le(data + pos + 28, 4));
+        pos += 32;
+        entries.push_back(std::move(e));
+    }
+    return entries;
+};
+
+static std::vector<unsigned char> read_whole_file(const char *filename) {
+    std::unique_ptr<FILE, int (*)(FILE *)> file(fopen(filename, "rb"),
+                                               fclose);
+    if (!file) {
+        throw std::runtime_error(_format("Failed to open %s", filename));
+    }
+    std::vector<unsigned char> data;
+    unsigned char buffer[1 << 16];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file.get())) > 0) {
+        data.insert(data.end(), buffer, buffer + n);
+    }
+    if (ferror(file.get())) {
+        throw std::runtime_error(_format("Failed to read %s", filename));
+    }
+    return data;
+};
+
+
+// Append clips to a new shard. The index is written when it's closed.
+struct ShardWriter {
+    std::string _filename;
+    std::string _sidecar;
+    FILE *_file = nullptr;
+    int64_t _offset = 0;
+    std::vector<ShardEntry> _entries;
+    std::unordered_map<std::string, size_t> _keys;
+    // Clips are appended without the GIL, so the file and the index are
+    // guarded by the mutex
+    std::mutex _mutex;
+
+    ShardWriter(const char *outfilename, const std::string &sidecar)
+        : _filename(outfilename), _sidecar(sidecar) {
+        _file = fopen(outfilename, "wb");
+        if (_file == nullptr) {
+            throw std::runtime_error(
+                _format("Failed to open %s", outfilename));
+        }
+        std::vector<unsigned char> header = {'W', 'V', 'S', 'H'};
+        put_le(header, 1, 4);
+        put_le(header, 0, 8);
+        _write(header.data(), header.size());
     };
+    ShardWriter(const ShardWriter &) = delete;
 
-    // Delete 'data' when the 'owner' capsule expires
-    nb::capsule owner(data, [](void *p) noexcept { delete[](int32_t *) p; });
+    void _write(const void *data, size_t size) {
+        uint32_t bcount;
+        if (!DoWriteFile(_file, const_cast<void *>(data),
+                         static_cast<uint32_t>(size), &bcount) ||
+            bcount != size) {
+            throw std::runtime_error(
+                _format("Failed to write %s", _filename.c_str()));
+        }
+        _offset += size;
+    };
 
-    auto array =
-        nb::ndarray<nb::numpy, int32_t>(data, /* ndim = */ 2, shape, owner);
-    auto sample_rate = wpcc.GetNativeSampleRate();
-    wpcc.CloseFile();
-    return std::tuple(array, sample_rate);
+    // The mutex must be held
+    void _check_key(const std::string &key) {
+        if (_file == nullptr) {
+            throw std::runtime_error("The shard is already closed");
+        }
+        if (_keys.count(key) > 0) {
+            throw std::invalid_argument(
+                _format("The key \"%s\" already exists", key.c_str()));
+        }
+    };
+
+    // The keys must be new and distinct. The mutex must be held.
+    void _check_keys(const std::vector<std::string> &keys) {
+        std::unordered_set<std::string> seen;
+        for (auto &key : keys) {
+            _check_key(key);
+            if (!seen.insert(key).second) {
+                throw std::invalid_argument(
+                    _format("The key \"%s\" is given more than once",
+                            key.c_str()));
+            }
+        }
+    };
+
+    void CheckKeys(const std::vector<std::string> &keys) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _check_keys(keys);
+    };
+
+    // Append complete WavPack streams, whose formats are taken from their
+    // headers. Nothing is appended if a key is invalid or a stream can't be
+    // read. The streams are freed as they are written.
+    void AddStreams(const std::vector<std::string> &keys,
+                    std::vector<std::vector<unsigned char>> &streams) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _check_keys(keys);
+        std::vector<ShardEntry> entries;
+        for (size_t i = 0; i < streams.size(); i++) {
+            auto wpcc = WavpackRead(streams[i].data(), streams[i].size(),
+                                    nullptr, 0, 0, 0);
+            check_readable(wpcc);
+            entries.push_back(
+                ShardEntry{keys[i], 0, static_cast<int64_t>(streams[i].size()),
+                           wpcc.GetNumSamples64(), wpcc.GetNativeSampleRate(),
+                           static_cast<uint32_t>(wpcc.GetNumChannels())});
+        }
+        for (size_t i = 0; i < streams.size(); i++) {
+            entries[i].offset = _offset;
+            _write(streams[i].data(), streams[i].size());
+            std::vector<unsigned char>().swap(streams[i]);
+            _keys[keys[i]] = _entries.size();
+            _entries.push_back(std::move(entries[i]));
+        }
+    };
+
+    size_t NumClips() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _entries.size();
+    };
+
+    void Close() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_file == nullptr) {
+            return;
+        }
+        std::vector<unsigned char> index;
+        put_shard_index(index, _entries);
+        auto index_offset = _offset;
+        std::vector<unsigned char> trailer;
+        put_le(trailer, index_offset, 8);
+        put_le(trailer, _entries.size(), 8);
+        trailer.insert(trailer.end(), {'W', 'V', 'S', 'X'});
+        put_le(trailer, 1, 4);
+        _write(index.data(), index.size());
+        _write(trailer.data(), trailer.size());
+        auto failed = fclose(_file) != 0;
+        _file = nullptr;
+        if (failed) {
+            throw std::runtime_error(
+                _format("Failed to write %s", _filename.c_str()));
+        }
+
+        if (!_sidecar.empty()) {
+            std::vector<unsigned char> out = {'W', 'V', 'S', 'I'};
+            put_le(out, 1, 4);
+            put_le(out, _entries.size(), 8);
+            out.insert(out.end(), index.begin(), index.end());
+            std::unique_ptr<FILE, int (*)(FILE *)> file(
+                fopen(_sidecar.c_str(), "wb"), fclose);
+            uint32_t bcount;
+            if (!file ||
+                !DoWriteFile(file.get(), out.data(),
+                             static_cast<uint32_t>(out.size()), &bcount) ||
+                bcount != out.size()) {
+                throw std::runtime_error(
+                    _format("Failed to write %s", _sidecar.c_str()));
+            }
+        }
+    };
+
+    ~ShardWriter() {
+        try {
+            Close();
+        } catch (...) {
+        }
+    };
+};
+
+
+// Encode arrays or read WavPack files (given by paths) on the native thread
+// pool and append them to the shard in the given order
+void shard_add_many(ShardWriter &self, const std::vector<std::string> &keys,
+                    nb::handle inputs, uint32_t sample_rate,
+                    int bits_per_sample, bool is_float,
+                    const std::string &mode, int extra, bool md5,
+                    int channel_mask, int num_threads) {
+    auto options = make_encode_options(bits_per_sample, is_float, mode, extra,
+                                       0.0, false, md5, channel_mask, 0);
+
+    // The arrays are kept referenced here until the GIL is reacquired
+    std::vector<InputArray> arrays;
+    std::vector<std::string> infilenames;
+    std::vector<EncodeSource> sources;
+    for (auto item : inputs) {
+        if (nb::isinstance<nb::str>(item)) {
+            infilenames.push_back(nb::cast<std::string>(item));
+            sources.push_back(EncodeSource{nullptr, SampleType::Int32, 0, 0});
+        } else {
+            if (sample_rate == 0) {
+                throw std::invalid_argument(
+                    "sample_rate is required to add arrays");
+            }
+            arrays.push_back(nb::cast<InputArray>(item));
+            infilenames.emplace_back();
+            sources.push_back(get_encode_source(arrays.back(), options));
+        }
+    }
+    if (sources.size() != keys.size()) {
+        throw std::invalid_argument(
+            "The numbers of keys and inputs must be the same");
+    }
+    // Before anything is encoded, so that an error leaves the shard as it is
+    self.CheckKeys(keys);
+
+    nb::gil_scoped_release release;
+    std::vector<std::vector<unsigned char>> streams(sources.size());
+    parallel_for(sources.size(), num_threads, [&](size_t i) {
+        try {
+            if (sources[i].data == nullptr) {
+                streams[i] = read_whole_file(infilenames[i].c_str());
+            } else {
+                streams[i] =
+                    encode_to_memory(sources[i], sample_rate, options);
+            }
+        } catch (const std::exception &e) {
+            throw std::runtime_error(
+                _format("%s: %s", keys[i].c_str(), e.what()));
+        }
+    });
+    self.AddStreams(keys, streams);
+};
+
+
+// Decode clips of a memory-mapped shard. Every clip is opened as a stream
+// over the mapped memory, so no system call is made per clip.
+struct ShardReader {
+    // Decoding is done without the GIL, so every Decode() holds its own
+    // reference to the mapping and Close() only drops this one, i.e. the
+    // file is unmapped after the last decoding finishes
+    std::shared_ptr<MappedFile> _file;
+    std::mutex _mutex;
+    std::vector<ShardEntry> _entries;
+    std::unordered_map<std::string, size_t> _keys;
+
+    ShardReader(const char *infilename, const std::string &sidecar) {
+        _file.reset(new MappedFile(infilename));
+        auto *data = _file->data;
+        auto size = _file->size;
+        if (size < shard_header_size + shard_trailer_size ||
+            std::memcmp(data, "WVSH", 4) != 0) {
+            throw std::runtime_error(
+                _format("%s is not a shard", infilename));
+        }
+        if (sidecar.empty()) {
+            auto *trailer = data + size - shard_trailer_size;
+            auto index_offset = get_le(trailer, 8);
+            auto count = get_le(trailer + 8, 8);
+            if (std::memcmp(trailer + 16, "WVSX", 4) != 0 ||
+                index_offset < shard_header_size ||
+                index_offset > size - shard_trailer_size) {
+                throw std::runtime_error(_format(
+                    "%s has no index, e.g. it wasn't closed", infilename));
+            }
+            _entries = get_shard_index(
+                data + index_offset,
+                size - shard_trailer_size - index_offset, count);
+        } else {
+            auto index = read_whole_file(sidecar.c_str());
+            if (index.size() < 16 || std::memcmp(index.data(), "WVSI", 4) != 0) {
+                throw std::runtime_error(
+                    _format("%s is not a shard index", sidecar.c_str()));
+            }
+            _entries = get_shard_index(index.data() + 16, index.size() - 16,
+                                       get_le(index.data() + 8, 8));
+        }
+        for (size_t i = 0; i < _entries.size(); i++) {
+            auto &e = _entries[i];
+            if (e.offset < static_cast<int64_t>(shard_header_size) ||
+                e.length <= 0 ||
+                static_cast<uint64_t>(e.offset + e.length) > size) {
+                throw std::runtime_error(
+                    _format("The clip \"%s\" is out of the shard",
+                            e.key.c_str()));
+            }
+            _keys[e.key] = i;
+        }
+    };
+    ShardReader(const ShardReader &) = delete;
+
+    // A key (str) or a position (int, negative from the end) of a clip
+    size_t Find(nb::handle key) {
+        if (nb::isinstance<nb::str>(key)) {
+            auto it = _keys.find(nb::cast<std::string>(key));
+            if (it == _keys.end()) {
+                throw nb::key_error(nb::cast<std::string>(key).c_str());
+            }
+            return it->second;
+        }
+        auto index = nb::cast<int64_t>(key);
+        auto n = static_cast<int64_t>(_entries.size());
+        if (index < 0) {
+            index += n;
+        }
+        if (index < 0 || index >= n) {
+            throw nb::index_error(
+                _format("The clip %lld is out of range for %lld clips",
+                        static_cast<long long>(nb::cast<int64_t>(key)),
+                        static_cast<long long>(n))
+                    .c_str());
+        }
+        return static_cast<size_t>(index);
+    };
+
+    // This doesn't touch any Python object
+    DecodedAudio Decode(size_t i, int64_t start, int64_t frames,
+                        SampleType type, const ChannelLayout &layout,
+                        int flags, int norm_offset) {
+        std::shared_ptr<MappedFile> file;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            file = _file;
+        }
+        if (!file) {
+            throw std::runtime_error("The shard is already closed");
+        }
+        auto &e = _entries[i];
+        auto wpcc = WavpackRead(file->data + e.offset,
+                                static_cast<size_t>(e.length), nullptr, 0,
+                                flags & ~OPEN_WVC, norm_offset);
+        return read_opened(wpcc, start, frames, type, layout);
+    };
+
+    void Close() {
+        std::shared_ptr<MappedFile> file;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            file.swap(_file);
+        }
+    };
+};
+
+
+// The result of verify() for one file
+struct VerifyReport {
+    std::string filename;
+    bool ok = false;
+    // Set if the file couldn't be verified at all, e.g. it can't be opened
+    std::string error;
+    int64_t num_blocks = 0;
+    // Blocks failing WavpackVerifySingleBlock() (ID_BLOCK_CHECKSUM), broken
+    // headers and garbage between blocks, in the .wv and .wvc files
+    int64_t bad_blocks = 0;
+    // CRC errors of the decoded samples reported by the library
+    int decode_errors = 0;
+    // The byte offset of the first bad block in the .wv file, or -1
+    int64_t first_bad_offset = -1;
+    int64_t num_samples = -1;
+    int64_t decoded_samples = 0;
+    // Hexadecimal; "md5" is empty if the file has no checksum, and
+    // "computed_md5" is empty if it wasn't computed
+    std::string md5;
+    std::string computed_md5;
+};
+
+// Check every block of a mapped .wv or .wvc file. The sample index and the
+// offset of every INITIAL_BLOCK with samples are appended to "starts".
+static void verify_blocks(const uint8_t *data, size_t size,
+                          VerifyReport &report, bool is_wvc,
+                          std::vector<std::pair<int64_t, int64_t>> &starts) {
+    char format[] = WavpackHeaderFormat;
+    std::vector<unsigned char> block;
+    auto bad_block = [&](int64_t offset) {
+        report.bad_blocks++;
+        if (!is_wvc && report.first_bad_offset < 0) {
+            report.first_bad_offset = offset;
+        }
+    };
+
+    size_t pos = 0;
+    while (pos + sizeof(WavpackHeader) <= size) {
+        if (std::memcmp(data + pos, "wvpk", 4) != 0) {
+            // APEv2 or ID3v1 tags at the end of the file
+            if ((pos + 8 <= size && std::memcmp(data + pos, "APETAGEX", 8) == 0) ||
+                (size - pos == 128 && std::memcmp(data + pos, "TAG", 3) == 0)) {
+                break;
+            }
+            // Resynchronize at the next block
+            bad_block(pos);
+            auto *next = static_cast<const uint8_t *>(
+                std::memchr(data + pos + 1, 'w', size - pos - 1));
+            while (next != nullptr && next + 4 <= data + size &&
+                   std::memcmp(next, "wvpk", 4) != 0) {
+                next = static_cast<const uint8_t *>(
+                    std::memchr(next + 1, 'w', data + size - next - 1));
+            }
+            if (next == nullptr || next + 4 > data + size) {
+                break;
+            }
+            pos = next - data;
+            continue;
+        }
+
+        WavpackHeader header;
+        std::memcpy(&header, data + pos, sizeof(header));
+        WavpackLittleEndianToNative(&header, format);
+        size_t block_size = header.ckSize + 8;
+        if (block_size < sizeof(header) || pos + block_size > size) {
+            // Truncated
+            bad_block(pos);
+            break;
+        }
+        // Copied because the buffer isn't const for the library
+        block.assign(data + pos, data + pos + block_size);
+        if (!WavpackVerifySingleBlock(block.data(), 1)) {
+            bad_block(pos);
+        }
+        if (header.block_samples > 0 && (header.flags & INITIAL_BLOCK)) {
+            starts.emplace_back(GET_BLOCK_INDEX(header), pos);
+        }
+        report.num_blocks++;
+        pos += block_size;
+    }
+};
+
+// Verify a file by checking the checksum of every block and by decoding it
+// into a small buffer to check the CRC of the samples and the MD5 checksum
+// of the whole audio. Nothing is thrown; failures are in the report.
+static VerifyReport verify_file(const std::string &infilename, bool md5,
+                                bool wvc) {
+    VerifyReport report;
+    report.filename = infilename;
+    try {
+        MappedFile file(infilename.c_str());
+        std::unique_ptr<MappedFile> wvc_file;
+        int64_t size, mtime;
+        auto wvc_filename = infilename + "c";
+        if (wvc && file_stat(wvc_filename.c_str(), &size, &mtime)) {
+            wvc_file.reset(new MappedFile(wvc_filename.c_str()));
+        }
+
+        std::vector<std::pair<int64_t, int64_t>> starts, wvc_starts;
+        verify_blocks(file.data, file.size, report, false, starts);
+        if (wvc_file) {
+            verify_blocks(wvc_file->data, wvc_file->size, report, true,
+                          wvc_starts);
+        }
+
+        auto wpcc = WavpackRead(file.data, file.size,
+                                wvc_file ? wvc_file->data : nullptr,
+                                wvc_file ? wvc_file->size : 0,
+                                wvc_file ? OPEN_WVC : 0, 0);
+        check_readable(wpcc);
+        report.num_samples = wpcc.GetNumSamples64();
+        auto channels = wpcc.GetNumChannels();
+        auto bytes_per_sample = wpcc.GetBytesPerSample();
+        auto qmode = wpcc.GetQualifyMode();
+        // The checksum is of the lossless audio, so it can't be compared
+        // for a lossy file without the correction file
+        auto check_md5 = md5 && (wpcc.GetMode() & MODE_LOSSLESS);
+
+        MD5Context context;
+        std::vector<int32_t> scratch(convert_block * channels);
+        int64_t first_bad_sample = -1;
+        // Every call stops at the next block, so that a CRC error is
+        // attributed to the block it's found in rather than to the chunk
+        size_t next = 0;
+        while (true) {
+            auto position = wpcc.GetSampleIndex64();
+            while (next < starts.size() && starts[next].first <= position) {
+                next++;
+            }
+            auto count = static_cast<int64_t>(convert_block);
+            if (next < starts.size()) {
+                count = std::min(count, starts[next].first - position);
+            }
+            auto ret = wpcc.UnpackSamples(scratch.data(),
+                                          static_cast<uint32_t>(count));
+            if (ret == 0) {
+                break;
+            }
+            if (check_md5) {
+                md5_update_samples(context, scratch.data(),
+                                   static_cast<size_t>(ret) * channels,
+                                   bytes_per_sample, qmode);
+            }
+            auto errors = wpcc.GetNumErrors();
+            if (errors > report.decode_errors && first_bad_sample < 0) {
+                first_bad_sample = position;
+            }
+            report.decode_errors = errors;
+            report.decoded_samples += ret;
+        }
+
+        // The (first) block of the frame with the first CRC error, as found
+        // by verify_blocks()
+        if (first_bad_sample >= 0) {
+            auto it = std::upper_bound(
+                starts.begin(), starts.end(), first_bad_sample,
+                [](int64_t s, const std::pair<int64_t, int64_t> &e) {
+                    return s < e.first;
+                });
+            auto offset = it == starts.begin() ? 0 : std::prev(it)->second;
+            if (report.first_bad_offset < 0 ||
+                offset < report.first_bad_offset) {
+                report.first_bad_offset = offset;
+            }
+        }
+
+        // The checksum is stored in the last block, so it's known only
+        // after decoding all the blocks
+        unsigned char digest[16];
+        if (wpcc.GetMd5sum(digest)) {
+            report.md5 = to_hex(digest, 16);
+        }
+        if (check_md5) {
+            context.final(digest);
+            report.computed_md5 = to_hex(digest, 16);
+        }
+    } catch (const std::exception &e) {
+        report.error = e.what();
+    }
+
+    report.ok = report.error.empty() && report.bad_blocks == 0 &&
+                report.decode_errors == 0 &&
+                (report.num_samples < 0 ||
+                 report.decoded_samples == report.num_samples) &&
+                (report.md5.empty() || report.computed_md5.empty() ||
+                 report.md5 == report.computed_md5);
+    return report;
+};
+
+
+// Per-channel statistics of the normalized samples, i.e. in [-1.0, 1.0) for
+// integer files, accumulated block by block
+struct AudioStats {
+    int64_t num_samples = 0;
+    uint32_t sample_rate = 0;
+    int channels = 0;
+    int bins = 0;
+    int decode_errors = 0;
+    // |x| >= clip_level counts as clipped
+    double clip_level = 1.0;
+    std::vector<double> peak;
+    std::vector<double> sum;
+    std::vector<double> sum_squares;
+    std::vector<int64_t> clipped;
+    // "bins" equal-width bins over [-1.0, 1.0] per channel. Values out of
+    // the range are counted in the first or the last bin.
+    std::vector<int64_t> histogram;
+};
+
+// The number of partial sums kept by the kernel. The lanes are independent,
+// so the compiler can keep them in one vector register.
+static const int stats_lanes = 4;
+
+// Accumulate "n" contiguous samples of the channel "c"
+static void accumulate_channel(const double *x, int64_t n, int c,
+                               AudioStats &stats) {
+    double peak[stats_lanes] = {}, sum[stats_lanes] = {},
+           sum_squares[stats_lanes] = {};
+    int64_t clipped[stats_lanes] = {};
+    auto clip_level = stats.clip_level;
+    int64_t i = 0;
+    for (; i + stats_lanes <= n; i += stats_lanes) {
+        for (int j = 0; j < stats_lanes; j++) {
+            auto v = x[i + j];
+            auto a = std::fabs(v);
+            peak[j] = a > peak[j] ? a : peak[j];
+            sum[j] += v;
+            sum_squares[j] += v * v;
+            clipped[j] += a >= clip_level;
+        }
+    }
+    for (; i < n; i++) {
+        auto a = std::fabs(x[i]);
+        peak[0] = a > peak[0] ? a : peak[0];
+        sum[0] += x[i];
+        sum_squares[0] += x[i] * x[i];
+        clipped[0] += a >= clip_level;
+    }
+    for (int j = 0; j < stats_lanes; j++) {
+        stats.peak[c] = std::max(stats.peak[c], peak[j]);
+        stats.sum[c] += sum[j];
+        stats.sum_squares[c] += sum_squares[j];
+        stats.clipped[c] += clipped[j];
+    }
+
+    auto *histogram = stats.histogram.data() + c * stats.bins;
+    auto half = stats.bins * 0.5;
+    for (i = 0; i < n; i++) {
+        // NaN goes to the first bin
+        auto v = x[i] > -1.0 ? x[i] : -1.0;
+        v = v < 1.0 ? v : 1.0;
+        auto bin = static_cast<int>((v + 1.0) * half);
+        histogram[bin < stats.bins ? bin : stats.bins - 1]++;
+    }
+};
+
+
+// Decode a file block by block and accumulate the statistics, reusing two
+// small scratch buffers. If "out" isn't NULL, the samples are also converted
+// into it as "type" in the same pass.
+static AudioStats analyze_file(const char *infilename, int flags,
+                               int norm_offset, int bins, double clip_level,
+                               DecodedAudio *out, SampleType type) {
+    if (bins <= 0) {
+        throw std::invalid_argument(
+            _format("bins must be positive, but got %d", bins));
+    }
+    auto wpcc = WavpackRead(infilename, flags, norm_offset);
+    check_readable(wpcc);
+    auto format = get_sample_format(wpcc);
+    auto channels = wpcc.GetNumChannels();
+
+    AudioStats stats;
+    stats.sample_rate = wpcc.GetNativeSampleRate();
+    stats.channels = channels;
+    stats.bins = bins;
+    // By default, the full scale of the format, i.e. the largest positive
+    // integer or 1.0 for float
+    stats.clip_level =
+        clip_level > 0 ? clip_level
+        : format.is_float
+            ? 1.0
+            : 1.0 - std::ldexp(1.0, -(format.bytes_per_sample * 8 - 1));
+    stats.peak.assign(channels, 0.0);
+    stats.sum.assign(channels, 0.0);
+    stats.sum_squares.assign(channels, 0.0);
+    stats.clipped.assign(channels, 0);
+    stats.histogram.assign(static_cast<size_t>(channels) * bins, 0);
+
+    auto total = wpcc.GetNumSamples64();
+    auto item_size = sample_type_size(type);
+    // The converted samples when the length is unknown
+    std::vector<uint8_t> grown;
+    if (out != nullptr) {
+        out->type = type;
+        out->channels = channels;
+        out->sample_rate = stats.sample_rate;
+        if (total >= 0) {
+            out->data = pool_allocate(total * channels * item_size);
+        }
+    }
+
+    std::vector<int32_t> scratch(convert_block * channels);
+    std::vector<double> converted(convert_block * channels);
+    std::vector<double> lane(convert_block);
+    while (true) {
+        auto n = static_cast<int64_t>(wpcc.UnpackSamples(
+            scratch.data(), static_cast<uint32_t>(convert_block)));
+        if (n == 0) {
+            break;
+        }
+        auto count = static_cast<size_t>(n) * channels;
+        if (out != nullptr) {
+            void *dst;
+            if (total >= 0) {
+                if (stats.num_samples + n > total) {
+                    throw std::runtime_error(
+                        "UnpackSamples returned more samples than expected");
+                }
+                dst = out->data.get() +
+                      stats.num_samples * channels * item_size;
+            } else {
+                grown.resize(grown.size() + count * item_size);
+                dst = grown.data() + grown.size() - count * item_size;
+            }
+            convert_samples(scratch.data(), dst, count, format, type);
+        }
+        convert_to_float(scratch.data(), converted.data(), count, format);
+        for (int c = 0; c < channels; c++) {
+            for (int64_t i = 0; i < n; i++) {
+                lane[i] = converted[i * channels + c];
+            }
+            accumulate_channel(lane.data(), n, c, stats);
+        }
+        stats.num_samples += n;
+    }
+    stats.decode_errors = wpcc.GetNumErrors();
+
+    if (out != nullptr) {
+        if (total < 0) {
+            out->data = pool_allocate(grown.size());
+            std::memcpy(out->data.get(), grown.data(), grown.size());
+        } else if (stats.num_samples != total) {
+            throw std::runtime_error(
+                _format("UnpackSamples returned %lld samples, but %lld "
+                        "samples were expected",
+                        static_cast<long long>(stats.num_samples),
+                        static_cast<long long>(total)));
+        }
+        out->frames = stats.num_samples;
+    }
+    return stats;
+};
+
+static nb::dict stats_to_dict(AudioStats &stats) {
+    std::vector<double> rms(stats.channels), dc(stats.channels);
+    for (int c = 0; c < stats.channels; c++) {
+        auto n = static_cast<double>(std::max<int64_t>(stats.num_samples, 1));
+        rms[c] = std::sqrt(stats.sum_squares[c] / n);
+        dc[c] = stats.sum[c] / n;
+    }
+    nb::dict result;
+    result["num_samples"] = stats.num_samples;
+    result["sample_rate"] = stats.sample_rate;
+    result["channels"] = stats.channels;
+    result["decode_errors"] = stats.decode_errors;
+    result["clip_level"] = stats.clip_level;
+    result["peak"] = to_column(std::move(stats.peak));
+    result["rms"] = to_column(std::move(rms));
+    result["dc"] = to_column(std::move(dc));
+    result["clipped"] = to_column(std::move(stats.clipped));
+    result["histogram"] = to_column(std::move(stats.histogram))
+                              .attr("reshape")(stats.channels, stats.bins);
+    return result;
+};
+
+
+// Analyze many files on a pool of native threads. Returns a list of the
+// dicts, or of (dict, (array, sample_rate)) if return_array is true.
+auto wavpack_analyze_many(const std::vector<std::string> &infilenames,
+                          int num_threads, int bins, double clip_level,
+                          bool return_array, nb::handle dtype, int flags,
+                          int norm_offset, int worker_threads) {
+    auto type = parse_sample_type(dtype);
+    flags = with_worker_threads(flags, worker_threads);
+    std::vector<AudioStats> stats(infilenames.size());
+    std::vector<DecodedAudio> audios(return_array ? infilenames.size() : 0);
+    {
+        nb::gil_scoped_release release;
+        parallel_for(infilenames.size(), num_threads, [&](size_t i) {
+            try {
+                stats[i] = analyze_file(infilenames[i].c_str(), flags,
+                                        norm_offset, bins, clip_level,
+                                        return_array ? &audios[i] : nullptr,
+                                        type);
+            } catch (const std::exception &e) {
+                throw std::runtime_error(
+                    _format("%s: %s", infilenames[i].c_str(), e.what()));
+            }
+        });
+    }
+    nb::list results;
+    for (size_t i = 0; i < stats.size(); i++) {
+        if (return_array) {
+            results.append(
+                nb::make_tuple(stats_to_dict(stats[i]), to_ndarray(audios[i])));
+        } else {
+            results.append(stats_to_dict(stats[i]));
+        }
+    }
+    return results;
 };
 
 
 NB_MODULE(pywavpack_ext, m) {
     m.def("read", &wavpack_read, "infilename"_a, "flags"_a = OPEN_WVC,
-          "norm_offset"_a = 0);
+          "norm_offset"_a = 0, "start"_a = 0, "frames"_a = -1,
+          "dtype"_a = "int32", "worker_threads"_a = 0,
+          "use_index"_a = false, "num_threads"_a = 1,
+          "channels"_a = nb::none(), "layout"_a = "interleaved");
+    m.def("read_bytes", &wavpack_read_bytes, "data"_a,
+          "wvc_data"_a = nb::none(), "flags"_a = OPEN_WVC,
+          "norm_offset"_a = 0, "start"_a = 0, "frames"_a = -1,
+          "dtype"_a = "int32", "worker_threads"_a = 0,
+          "channels"_a = nb::none(), "layout"_a = "interleaved");
+    m.def("read_many", &wavpack_read_many, "infilenames"_a,
+          "flags"_a = OPEN_WVC, "norm_offset"_a = 0, "num_threads"_a = 0,
+          "dtype"_a = "int32", "worker_threads"_a = 0,
+          "channels"_a = nb::none(), "layout"_a = "interleaved");
+    m.def("read_async", &wavpack_read_async, "callback"_a, "infilename"_a,
+          "flags"_a = OPEN_WVC, "norm_offset"_a = 0, "start"_a = 0,
+          "frames"_a = -1, "dtype"_a = "int32", "worker_threads"_a = 0,
+          "use_index"_a = false, "num_threads"_a = 1,
+          "channels"_a = nb::none(), "layout"_a = "interleaved");
+    nb::module_::import_("atexit").attr("register")(
+        nb::cpp_function([]() {
+            async_tasks.stop();
+            close_prefetchers();
+        }));
+    m.def("read_crops", &wavpack_read_crops, "infilenames"_a, "offsets"_a,
+          "frames"_a, "out"_a = nb::none(), "dtype"_a = nb::none(),
+          "pad"_a = false, "num_threads"_a = 0, "use_index"_a = false,
+          "flags"_a = OPEN_WVC, "norm_offset"_a = 0, "worker_threads"_a = 0);
+    m.def(
+        "info",
+        [](const char *infilename, bool md5, bool tags) {
+            return get_info(infilename, md5, tags);
+        },
+        "infilename"_a, "md5"_a = true, "tags"_a = true,
+        nb::call_guard<nb::gil_scoped_release>());
+    m.def("info_many", &wavpack_info_many, "infilenames"_a,
+          "num_threads"_a = 0, "md5"_a = false, "tags"_a = false,
+          "errors"_a = "raise");
+    m.def("verify", &verify_file, "infilename"_a, "md5"_a = true,
+          "wvc"_a = true, nb::call_guard<nb::gil_scoped_release>());
+    m.def(
+        "verify_many",
+        [](const std::vector<std::string> &infilenames, int num_threads,
+           bool md5, bool wvc) {
+            std::vector<VerifyReport> reports(infilenames.size());
+            parallel_for(infilenames.size(), num_threads, [&](size_t i) {
+                reports[i] = verify_file(infilenames[i], md5, wvc);
+            });
+            return reports;
+        },
+        "infilenames"_a, "num_threads"_a = 0, "md5"_a = true, "wvc"_a = true,
+        nb::call_guard<nb::gil_scoped_release>());
+    m.def(
+        "analyze",
+        [](const char *infilename, int bins, double clip_level,
+           bool return_array, nb::handle dtype, int flags, int norm_offset,
+           int worker_threads) -> nb::object {
+            auto type = parse_sample_type(dtype);
+            flags = with_worker_threads(flags, worker_threads);
+            AudioStats stats;
+            DecodedAudio audio;
+            {
+                nb::gil_scoped_release release;
+                stats = analyze_file(infilename, flags, norm_offset, bins,
+                                     clip_level,
+                                     return_array ? &audio : nullptr, type);
+            }
+            if (return_array) {
+                return nb::make_tuple(stats_to_dict(stats),
+                                      to_ndarray(audio));
+            }
+            return stats_to_dict(stats);
+        },
+        "infilename"_a, "bins"_a = 256, "clip_level"_a = 0.0,
+        "return_array"_a = false, "dtype"_a = "int32", "flags"_a = OPEN_WVC,
+        "norm_offset"_a = 0, "worker_threads"_a = 0);
+    m.def("analyze_many", &wavpack_analyze_many, "infilenames"_a,
+          "num_threads"_a = 0, "bins"_a = 256, "clip_level"_a = 0.0,
+          "return_array"_a = false, "dtype"_a = "int32",
+          "flags"_a = OPEN_WVC, "norm_offset"_a = 0, "worker_threads"_a = 0);
+    m.def("write", &wavpack_write, "outfilename"_a, "array"_a,
+          "sample_rate"_a, "bits_per_sample"_a = 0, "is_float"_a = false,
+          "mode"_a = "normal", "extra"_a = 0, "bitrate"_a = 0.0,
+          "wvc"_a = false, "md5"_a = false, "channel_mask"_a = 0,
+          "worker_threads"_a = 0);
+    m.def("write_many", &wavpack_write_many, "outfilenames"_a, "inputs"_a,
+          "sample_rate"_a = 0, "bits_per_sample"_a = 0, "is_float"_a = false,
+          "mode"_a = "normal", "extra"_a = 0, "bitrate"_a = 0.0,
+          "wvc"_a = false, "md5"_a = false, "channel_mask"_a = 0,
+          "worker_threads"_a = 0, "num_threads"_a = 0);
+    m.def(
+        "compress_file",
+        [](const char *infilename, const char *outfilename,
+           const std::string &mode, int extra, double bitrate, bool wvc,
+           bool md5, int worker_threads, int64_t chunk_frames, int prefetch) {
+            auto options = make_encode_options(16, false, mode, extra,
+                                               bitrate, wvc, md5, 0,
+                                               worker_threads);
+            compress_file(infilename, outfilename, options, chunk_frames,
+                          prefetch);
+        },
+        "infilename"_a, "outfilename"_a, "mode"_a = "normal", "extra"_a = 0,
+        "bitrate"_a = 0.0, "wvc"_a = false, "md5"_a = false,
+        "worker_threads"_a = 0, "chunk_frames"_a = 1 << 16,
+        "prefetch"_a = 4, nb::call_guard<nb::gil_scoped_release>());
+    m.def("decompress_file", &decompress_file, "infilename"_a,
+          "outfilename"_a, "md5"_a = true, "chunk_frames"_a = 1 << 16,
+          "prefetch"_a = 4, nb::call_guard<nb::gil_scoped_release>());
+    m.def("compress_many", &wavpack_compress_many, "infilenames"_a,
+          "outfilenames"_a, "mode"_a = "normal", "extra"_a = 0,
+          "bitrate"_a = 0.0, "wvc"_a = false, "md5"_a = false,
+          "worker_threads"_a = 0, "chunk_frames"_a = 1 << 16,
+          "prefetch"_a = 4, "num_threads"_a = 0);
+    m.def("decompress_many", &wavpack_decompress_many, "infilenames"_a,
+          "outfilenames"_a, "md5"_a = true, "chunk_frames"_a = 1 << 16,
+          "prefetch"_a = 4, "num_threads"_a = 0);
+    m.def("compress_dir", &wavpack_compress_dir, "indir"_a, "outdir"_a,
+          "mode"_a = "normal", "extra"_a = 0, "bitrate"_a = 0.0,
+          "wvc"_a = false, "md5"_a = false, "worker_threads"_a = 0,
+          "chunk_frames"_a = 1 << 16, "prefetch"_a = 4, "num_threads"_a = 0);
+    m.def("decompress_dir", &wavpack_decompress_dir, "indir"_a, "outdir"_a,
+          "md5"_a = true, "chunk_frames"_a = 1 << 16, "prefetch"_a = 4,
+          "num_threads"_a = 0);
+    m.def(
+        "get_seek_index",
+        [](const std::string &infilename, const std::string &sidecar) {
+            return get_seek_index(infilename, sidecar);
+        },
+        "infilename"_a, "sidecar"_a = "",
+        nb::call_guard<nb::gil_scoped_release>());
+    m.def("clear_seek_index_cache", []() {
+        std::lock_guard<std::mutex> lock(seek_index_mutex);
+        seek_index_cache.clear();
+    });
+    m.def(
+        "configure_buffer_pool",
+        [](bool enabled, size_t max_bytes, bool hugepages) {
+            {
+                std::lock_guard<std::mutex> lock(buffer_pool.mutex);
+                buffer_pool.enabled = enabled;
+                buffer_pool.max_bytes = max_bytes;
+                buffer_pool.hugepages = hugepages;
+            }
+            pool_trim(enabled ? max_bytes : 0);
+        },
+        "enabled"_a = true, "max_bytes"_a = 256 << 20, "hugepages"_a = false,
+        nb::call_guard<nb::gil_scoped_release>());
+    m.def("stats", []() {
+        nb::dict stats;
+        stats["files_opened"] = perf_counters.files_opened.load();
+        stats["bytes_read"] = perf_counters.bytes_read.load();
+        stats["blocks_decoded"] = perf_counters.blocks_decoded.load();
+        stats["samples_decoded"] = perf_counters.samples_decoded.load();
+        stats["samples_encoded"] = perf_counters.samples_encoded.load();
+        stats["seeks"] = perf_counters.seeks.load();
+        stats["unpack_ns"] = perf_counters.unpack_ns.load();
+        stats["convert_ns"] = perf_counters.convert_ns.load();
+        stats["alloc_ns"] = perf_counters.alloc_ns.load();
+        stats["pack_ns"] = perf_counters.pack_ns.load();
+        return stats;
+    });
+    m.def("reset_stats", []() {
+        for (auto *counter :
+             {&perf_counters.files_opened, &perf_counters.bytes_read,
+              &perf_counters.blocks_decoded, &perf_counters.samples_decoded,
+              &perf_counters.samples_encoded, &perf_counters.seeks,
+              &perf_counters.unpack_ns, &perf_counters.convert_ns,
+              &perf_counters.alloc_ns, &perf_counters.pack_ns}) {
+            counter->store(0);
+        }
+    });
+    m.def("buffer_pool_stats", []() {
+        // Copied first, because releasing a Python object may return a
+        // buffer and lock the mutex again
+        bool enabled, hugepages;
+        size_t max_bytes, cached_bytes, cached_buffers, in_use_bytes,
+            in_use_buffers;
+        int64_t hits, misses;
+        {
+            std::lock_guard<std::mutex> lock(buffer_pool.mutex);
+            enabled = buffer_pool.enabled;
+            hugepages = buffer_pool.hugepages;
+            max_bytes = buffer_pool.max_bytes;
+            cached_bytes = buffer_pool.cached_bytes;
+            cached_buffers = buffer_pool.cached_buffers;
+            in_use_bytes = buffer_pool.in_use_bytes;
+            in_use_buffers = buffer_pool.in_use_buffers;
+            hits = buffer_pool.hits;
+            misses = buffer_pool.misses;
+        }
+        nb::dict stats;
+        stats["enabled"] = enabled;
+        stats["hugepages"] = hugepages;
+        stats["max_bytes"] = max_bytes;
+        stats["cached_bytes"] = cached_bytes;
+        stats["cached_buffers"] = cached_buffers;
+        stats["in_use_bytes"] = in_use_bytes;
+        stats["in_use_buffers"] = in_use_buffers;
+        stats["hits"] = hits;
+        stats["misses"] = misses;
+        return stats;
+    });
+    m.def("trim_buffer_pool", &pool_trim, "keep_bytes"_a = 0,
+          nb::call_guard<nb::gil_scoped_release>());
     m.def("GetLibraryVersion", &WavpackGetLibraryVersion);
     m.def("GetLibraryVersionString", &WavpackGetLibraryVersionString);
 
     nb::class_<WavpackRead>(m, "WavpackRead")
-        .def(nb::init<const char *, int, int>(), "infilename"_a,
-             "flags"_a = OPEN_WVC, "norm_offset"_a = 0)
+        .def(
+            "__init__",
+            [](WavpackRead *self, const char *infilename, int flags,
+               int norm_offset, int worker_threads) {
+                new (self)
+                    WavpackRead(infilename,
+                                with_worker_threads(flags, worker_threads),
+                                norm_offset);
+            },
+            "infilename"_a, "flags"_a = OPEN_WVC, "norm_offset"_a = 0,
+            "worker_threads"_a = 0)
+        .def(
+            "__init__",
+            [](WavpackRead *self, nb::handle data, nb::handle wvc_data,
+               int flags, int norm_offset, int worker_threads) {
+                flags = with_worker_threads(flags, worker_threads);
+                std::unique_ptr<PythonBuffer> buffer(new PythonBuffer(data));
+                std::unique_ptr<PythonBuffer> wvc_buffer;
+                if (!wvc_data.is_none()) {
+                    wvc_buffer.reset(new PythonBuffer(wvc_data));
+                }
+                new (self) WavpackRead(std::move(buffer),
+                                       std::move(wvc_buffer), flags,
+                                       norm_offset);
+            },
+            "data"_a, "wvc_data"_a = nb::none(), "flags"_a = OPEN_WVC,
+            "norm_offset"_a = 0, "worker_threads"_a = 0)
         .def(
             "__enter__",
             [](WavpackRead &self) -> WavpackRead & {
@@ -335,12 +5853,15 @@ NB_MODULE(pywavpack_ext, m) {
             [](WavpackRead &self, nb::object &, nb::object &,
                nb::object &) {
                 // [](WavpackRead& self, void*, void*, void*) {
+                auto lock = self.Lock(false);
                 self.CloseFile();
                 return;
             },
             "exc_type"_a.none(), "exc_value"_a.none(), "traceback"_a.none())
         .def("GetMode", &WavpackRead::GetMode)
         .def("GetErrorMessage", &WavpackRead::GetErrorMessage)
+        .def("GetOpenFlags", &WavpackRead::GetOpenFlags)
+        .def("GetNormOffset", &WavpackRead::GetNormOffset)
         .def("GetMode", &WavpackRead::GetMode)
         .def("GetNumChannels", &WavpackRead::GetNumChannels)
         .def("GetReducedChannels", &WavpackRead::GetReducedChannels)
@@ -366,21 +5887,413 @@ NB_MODULE(pywavpack_ext, m) {
              "count_wvc"_a)
         .def("GetFloatNormExp", &WavpackRead::GetFloatNormExp)
         .def("GetMd5sum", &WavpackRead::GetMd5sum, "data"_a)
+        .def("GetNumTagItems", &WavpackRead::GetNumTagItems)
+        .def("GetTagItemIndexed", &WavpackRead::GetTagItemIndexed, "index"_a)
+        .def("GetTagItem", &WavpackRead::GetTagItem, "item"_a)
         .def("GetWrapperBytes", &WavpackRead::GetWrapperBytes)
         .def("GetWrapperData", &WavpackRead::GetWrapperData)
         .def("FreeWrapper", &WavpackRead::FreeWrapper)
         .def("SeekTrailingWrapper", &WavpackRead::SeekTrailingWrapper)
-        .def("UnpackSamples", &WavpackRead::UnpackSamples, "samples"_a,
-             "buffer"_a)
-        .def("SeekSample64", &WavpackRead::SeekSample64, "sample"_a)
-        .def("SeekSample", &WavpackRead::SeekSample, "sample"_a)
+        .def(
+            "UnpackSamples",
+            [](WavpackRead &self, int32_t *buffer, uint32_t samples) {
+                auto lock = self.Lock();
+                return self.UnpackSamples(buffer, samples);
+            },
+            "samples"_a, "buffer"_a, nb::call_guard<nb::gil_scoped_release>())
+        .def(
+            "SeekSample64",
+            [](WavpackRead &self, uint64_t sample) {
+                auto lock = self.Lock();
+                return self.SeekSample64(sample);
+            },
+            "sample"_a, nb::call_guard<nb::gil_scoped_release>())
+        .def(
+            "SeekSample",
+            [](WavpackRead &self, uint32_t sample) {
+                auto lock = self.Lock();
+                return self.SeekSample(sample);
+            },
+            "sample"_a, nb::call_guard<nb::gil_scoped_release>())
         .def("GetSampleIndex64", &WavpackRead::GetSampleIndex64)
         .def("GetSampleIndex", &WavpackRead::GetSampleIndex)
+        .def("SetSeekIndex", &WavpackRead::SetSeekIndex, "index"_a)
+        .def("GetSeekIndex", &WavpackRead::GetSeekIndex)
         .def("GetInstantBitrate", &WavpackRead::GetInstantBitrate)
         .def("GetNumErrors", &WavpackRead::GetNumErrors)
         .def("GetLossyBlocks", &WavpackRead::GetLossyBlocks)
         .def("GetProgress", &WavpackRead::GetProgress)
-        .def("CloseFile", &WavpackRead::CloseFile);
+        .def(
+            "CloseFile",
+            [](WavpackRead &self) {
+                auto lock = self.Lock(false);
+                self.CloseFile();
+            })
+        .def("readinto", &wavpack_readinto, "out"_a)
+        .def("iter_blocks", &wavpack_iter_blocks, "frames_per_block"_a,
+             "dtype"_a = nb::none(), "out"_a = nb::none(),
+             nb::keep_alive<0, 1>());
+
+    nb::class_<WavpackArray>(m, "WavpackArray")
+        .def(
+            "__init__",
+            [](WavpackArray *self, const char *infilename, nb::handle dtype,
+               size_t cache_size, int flags, int norm_offset) {
+                auto type = parse_sample_type(dtype);
+                nb::gil_scoped_release release;
+                new (self) WavpackArray(infilename, type, flags, norm_offset,
+                                        cache_size);
+            },
+            "infilename"_a, "dtype"_a = "int32", "cache_size"_a = 64 << 20,
+            "flags"_a = OPEN_WVC, "norm_offset"_a = 0)
+        .def(
+            "__enter__",
+            [](WavpackArray &self) -> WavpackArray & {
+                return self;
+            },
+            nb::rv_policy::reference)
+        .def(
+            "__exit__",
+            [](WavpackArray &self, nb::object &, nb::object &,
+               nb::object &) {
+                nb::gil_scoped_release release;
+                self.Close();
+                return;
+            },
+            "exc_type"_a.none(), "exc_value"_a.none(), "traceback"_a.none())
+        .def("__getitem__", &WavpackArray::GetItem, "key"_a)
+        .def("__len__", &WavpackArray::NumFrames)
+        .def(
+            "__array__",
+            [](WavpackArray &self, nb::handle dtype, nb::handle) {
+                auto array = self.ToArray();
+                if (!dtype.is_none()) {
+                    return array.attr("astype")(dtype);
+                }
+                return array;
+            },
+            "dtype"_a = nb::none(), "copy"_a = nb::none())
+        .def_prop_ro("shape",
+                     [](WavpackArray &self) {
+                         return std::make_tuple(self.NumFrames(),
+                                                self._channels);
+                     })
+        .def_prop_ro("ndim", [](WavpackArray &) { return 2; })
+        .def_prop_ro("dtype",
+                     [](WavpackArray &self) {
+                         return nb::module_::import_("numpy").attr("dtype")(
+                             sample_type_name(self._type));
+                     })
+        .def_ro("sample_rate", &WavpackArray::_sample_rate)
+        .def("cache_info", &WavpackArray::CacheInfo)
+        .def("close", &WavpackArray::Close,
+             nb::call_guard<nb::gil_scoped_release>());
+
+    nb::class_<BlockPrefetcher>(m, "BlockPrefetcher")
+        .def(
+            "__init__",
+            [](BlockPrefetcher *self, const std::string &infilename,
+               int64_t frames_per_block, nb::handle notify, nb::handle dtype,
+               int64_t start, size_t prefetch, int flags, int norm_offset,
+               int worker_threads) {
+                if (frames_per_block <= 0) {
+                    throw std::invalid_argument(_format(
+                        "frames_per_block must be positive, but got %lld",
+                        static_cast<long long>(frames_per_block)));
+                }
+                auto type = parse_sample_type(dtype);
+                new (self) BlockPrefetcher(
+                    infilename, with_worker_threads(flags, worker_threads),
+                    norm_offset, start, frames_per_block, type, prefetch,
+                    notify);
+            },
+            "infilename"_a, "frames_per_block"_a, "notify"_a,
+            "dtype"_a = "int32", "start"_a = 0, "prefetch"_a = 4,
+            "flags"_a = OPEN_WVC, "norm_offset"_a = 0, "worker_threads"_a = 0)
+        .def("poll", &BlockPrefetcher::Poll)
+        .def("close", &BlockPrefetcher::Close,
+             nb::call_guard<nb::gil_scoped_release>());
+
+    nb::class_<ShardWriter>(m, "ShardWriter")
+        .def(nb::init<const char *, const std::string &>(), "outfilename"_a,
+             "sidecar"_a = "")
+        .def(
+            "__enter__",
+            [](ShardWriter &self) -> ShardWriter & {
+                return self;
+            },
+            nb::rv_policy::reference)
+        .def(
+            "__exit__",
+            [](ShardWriter &self, nb::object &, nb::object &,
+               nb::object &) {
+                self.Close();
+                return;
+            },
+            "exc_type"_a.none(), "exc_value"_a.none(), "traceback"_a.none())
+        .def(
+            "add",
+            [](ShardWriter &self, const std::string &key, nb::handle input,
+               uint32_t sample_rate, int bits_per_sample, bool is_float,
+               const std::string &mode, int extra, bool md5,
+               int channel_mask) {
+                auto inputs = nb::make_tuple(input);
+                shard_add_many(self, {key}, inputs, sample_rate,
+                               bits_per_sample, is_float, mode, extra, md5,
+                               channel_mask, 1);
+            },
+            "key"_a, "input"_a, "sample_rate"_a = 0, "bits_per_sample"_a = 0,
+            "is_float"_a = false, "mode"_a = "normal", "extra"_a = 0,
+            "md5"_a = false, "channel_mask"_a = 0)
+        .def("add_many", &shard_add_many, "keys"_a, "inputs"_a,
+             "sample_rate"_a = 0, "bits_per_sample"_a = 0,
+             "is_float"_a = false, "mode"_a = "normal", "extra"_a = 0,
+             "md5"_a = false, "channel_mask"_a = 0, "num_threads"_a = 0)
+        .def("__len__", &ShardWriter::NumClips)
+        .def("close", &ShardWriter::Close,
+             nb::call_guard<nb::gil_scoped_release>());
+
+    nb::class_<ShardReader>(m, "ShardReader")
+        .def(
+            "__init__",
+            [](ShardReader *self, const char *infilename,
+               const std::string &sidecar) {
+                nb::gil_scoped_release release;
+                new (self) ShardReader(infilename, sidecar);
+            },
+            "infilename"_a, "sidecar"_a = "")
+        .def(
+            "__enter__",
+            [](ShardReader &self) -> ShardReader & {
+                return self;
+            },
+            nb::rv_policy::reference)
+        .def(
+            "__exit__",
+            [](ShardReader &self, nb::object &, nb::object &,
+               nb::object &) {
+                self.Close();
+                return;
+            },
+            "exc_type"_a.none(), "exc_value"_a.none(), "traceback"_a.none())
+        .def("__len__",
+             [](ShardReader &self) { return self._entries.size(); })
+        .def("__contains__",
+             [](ShardReader &self, const std::string &key) {
+                 return self._keys.count(key) > 0;
+             })
+        .def("keys",
+             [](ShardReader &self) {
+                 std::vector<std::string> keys;
+                 for (auto &e : self._entries) {
+                     keys.push_back(e.key);
+                 }
+                 return keys;
+             })
+        .def(
+            "info",
+            [](ShardReader &self, nb::handle key) {
+                auto &e = self._entries[self.Find(key)];
+                nb::dict info;
+                info["key"] = e.key;
+                info["num_samples"] = e.num_samples;
+                info["sample_rate"] = e.sample_rate;
+                info["channels"] = e.channels;
+                info["offset"] = e.offset;
+                info["length"] = e.length;
+                return info;
+            },
+            "key"_a)
+        .def(
+            "read",
+            [](ShardReader &self, nb::handle key, int64_t start,
+               int64_t frames, nb::handle dtype, nb::handle channels,
+               const std::string &layout, int flags, int norm_offset) {
+                auto i = self.Find(key);
+                auto type = parse_sample_type(dtype);
+                auto channel_layout = parse_channel_layout(channels, layout);
+                DecodedAudio audio;
+                {
+                    nb::gil_scoped_release release;
+                    audio = self.Decode(i, start, frames, type,
+                                        channel_layout, flags, norm_offset);
+                }
+                return to_ndarray(audio);
+            },
+            "key"_a, "start"_a = 0, "frames"_a = -1, "dtype"_a = "int32",
+            "channels"_a = nb::none(), "layout"_a = "interleaved",
+            "flags"_a = 0, "norm_offset"_a = 0)
+        .def(
+            "read_many",
+            [](ShardReader &self, nb::handle keys, nb::handle starts,
+               int64_t frames, int num_threads, nb::handle dtype,
+               nb::handle channels, const std::string &layout, int flags,
+               int norm_offset) {
+                std::vector<size_t> indices;
+                for (auto key : keys) {
+                    indices.push_back(self.Find(key));
+                }
+                std::vector<int64_t> offsets(indices.size(), 0);
+                if (!starts.is_none()) {
+                    offsets = nb::cast<std::vector<int64_t>>(starts);
+                    if (offsets.size() != indices.size()) {
+                        throw std::invalid_argument(
+                            "The numbers of keys and starts must be the "
+                            "same");
+                    }
+                }
+                auto type = parse_sample_type(dtype);
+                auto channel_layout = parse_channel_layout(channels, layout);
+                std::vector<DecodedAudio> audios(indices.size());
+                {
+                    nb::gil_scoped_release release;
+                    parallel_for(indices.size(), num_threads, [&](size_t i) {
+                        try {
+                            audios[i] = self.Decode(indices[i], offsets[i],
+                                                    frames, type,
+                                                    channel_layout, flags,
+                                                    norm_offset);
+                        } catch (const std::exception &e) {
+                            throw std::runtime_error(_format(
+                                "%s: %s",
+                                self._entries[indices[i]].key.c_str(),
+                                e.what()));
+                        }
+                    });
+                }
+                nb::list results;
+                for (auto &audio : audios) {
+                    results.append(to_ndarray(audio));
+                }
+                return results;
+            },
+            "keys"_a, "starts"_a = nb::none(), "frames"_a = -1,
+            "num_threads"_a = 0, "dtype"_a = "int32",
+            "channels"_a = nb::none(), "layout"_a = "interleaved",
+            "flags"_a = 0, "norm_offset"_a = 0)
+        .def("close", [](ShardReader &self) { self.Close(); });
+
+    nb::class_<VerifyReport>(m, "VerifyReport")
+        .def_ro("filename", &VerifyReport::filename)
+        .def_ro("ok", &VerifyReport::ok)
+        .def_ro("error", &VerifyReport::error)
+        .def_ro("num_blocks", &VerifyReport::num_blocks)
+        .def_ro("bad_blocks", &VerifyReport::bad_blocks)
+        .def_ro("decode_errors", &VerifyReport::decode_errors)
+        .def_ro("first_bad_offset", &VerifyReport::first_bad_offset)
+        .def_ro("num_samples", &VerifyReport::num_samples)
+        .def_ro("decoded_samples", &VerifyReport::decoded_samples)
+        .def_ro("md5", &VerifyReport::md5)
+        .def_ro("computed_md5", &VerifyReport::computed_md5)
+        .def("__bool__", [](const VerifyReport &self) { return self.ok; })
+        .def("__repr__", [](const VerifyReport &self) {
+            return _format("VerifyReport(filename='%s', ok=%s, "
+                           "bad_blocks=%lld, decode_errors=%d, "
+                           "first_bad_offset=%lld)",
+                           self.filename.c_str(),
+                           self.ok ? "True" : "False",
+                           static_cast<long long>(self.bad_blocks),
+                           self.decode_errors,
+                           static_cast<long long>(self.first_bad_offset));
+        });
+
+    nb::class_<WavpackInfo>(m, "WavpackInfo")
+        .def_ro("num_samples", &WavpackInfo::num_samples)
+        .def_ro("sample_rate", &WavpackInfo::sample_rate)
+        .def_ro("channels", &WavpackInfo::channels)
+        .def_ro("bits_per_sample", &WavpackInfo::bits_per_sample)
+        .def_ro("bytes_per_sample", &WavpackInfo::bytes_per_sample)
+        .def_ro("mode", &WavpackInfo::mode)
+        .def_ro("channel_mask", &WavpackInfo::channel_mask)
+        .def_ro("file_size", &WavpackInfo::file_size)
+        .def_ro("md5", &WavpackInfo::md5)
+        .def_ro("tags", &WavpackInfo::tags)
+        .def("__repr__", [](const WavpackInfo &self) {
+            return _format("WavpackInfo(num_samples=%lld, sample_rate=%u, "
+                           "channels=%d, bits_per_sample=%d, mode=0x%x)",
+                           static_cast<long long>(self.num_samples),
+                           self.sample_rate, self.channels,
+                           self.bits_per_sample, self.mode);
+        });
+
+    nb::class_<WavpackSeekIndex>(m, "WavpackSeekIndex")
+        .def_static("build", &WavpackSeekIndex::build, "infilename"_a,
+                    nb::call_guard<nb::gil_scoped_release>())
+        .def_static("load", &WavpackSeekIndex::load, "filename"_a,
+                    nb::call_guard<nb::gil_scoped_release>())
+        .def("save", &WavpackSeekIndex::save, "filename"_a,
+             nb::call_guard<nb::gil_scoped_release>())
+        .def(
+            "find",
+            [](const WavpackSeekIndex &self, int64_t sample) {
+                auto i = self.find(sample);
+                if (i < 0) {
+                    throw nb::index_error(
+                        _format("The sample %lld is out of range",
+                                static_cast<long long>(sample))
+                            .c_str());
+                }
+                auto &e = self.entries[i];
+                return std::make_tuple(e.block_index, e.block_samples,
+                                       e.offset, e.size);
+            },
+            "sample"_a)
+        .def("__len__",
+             [](const WavpackSeekIndex &self) { return self.entries.size(); })
+        .def_ro("total_samples", &WavpackSeekIndex::total_samples)
+        .def_ro("file_size", &WavpackSeekIndex::file_size)
+        .def_ro("mtime", &WavpackSeekIndex::mtime);
+
+    nb::class_<WavpackWrite>(m, "WavpackWrite")
+        .def(
+            "__init__",
+            [](WavpackWrite *self, const char *outfilename,
+               uint32_t sample_rate, int channels, int bits_per_sample,
+               bool is_float, const std::string &mode, int extra,
+               double bitrate, bool wvc, bool md5, int64_t total_frames,
+               int channel_mask, int worker_threads) {
+                auto options = make_encode_options(
+                    bits_per_sample, is_float, mode, extra, bitrate, wvc, md5,
+                    channel_mask, worker_threads);
+                new (self) WavpackWrite(outfilename, sample_rate, channels,
+                                        total_frames, options);
+            },
+            "outfilename"_a, "sample_rate"_a, "channels"_a,
+            "bits_per_sample"_a = 16, "is_float"_a = false,
+            "mode"_a = "normal", "extra"_a = 0, "bitrate"_a = 0.0,
+            "wvc"_a = false, "md5"_a = false, "total_frames"_a = -1,
+            "channel_mask"_a = 0, "worker_threads"_a = 0)
+        .def(
+            "__enter__",
+            [](WavpackWrite &self) -> WavpackWrite & {
+                return self;
+            },
+            nb::rv_policy::reference)
+        .def(
+            "__exit__",
+            [](WavpackWrite &self, nb::object &, nb::object &,
+               nb::object &) {
+                self.CloseFile();
+                return;
+            },
+            "exc_type"_a.none(), "exc_value"_a.none(), "traceback"_a.none())
+        .def("write", &wavpack_write_samples, "array"_a)
+        .def("GetNumChannels", &WavpackWrite::GetNumChannels)
+        .def("GetBitsPerSample", &WavpackWrite::GetBitsPerSample)
+        .def("GetNumSamples64", &WavpackWrite::GetNumSamples64)
+        .def("FlushSamples", &WavpackWrite::FlushSamples,
+             nb::call_guard<nb::gil_scoped_release>())
+        .def("CloseFile", &WavpackWrite::CloseFile,
+             nb::call_guard<nb::gil_scoped_release>());
+
+    nb::class_<WavpackBlockIterator>(m, "WavpackBlockIterator")
+        .def(
+            "__iter__",
+            [](WavpackBlockIterator &self) -> WavpackBlockIterator & {
+                return self;
+            },
+            nb::rv_policy::reference)
+        .def("__next__", &WavpackBlockIterator::next);
 
     m.attr("ChunkHeaderFormat") = ChunkHeaderFormat;
     m.attr("WaveHeaderFormat") = WaveHeaderFormat;
@@ -494,6 +6407,10 @@ NB_MODULE(pywavpack_ext, m) {
     m.attr("OPEN_DSD_AS_PCM") = OPEN_DSD_AS_PCM;
     m.attr("OPEN_ALT_TYPES") = OPEN_ALT_TYPES;
     m.attr("OPEN_NO_CHECKSUM") = OPEN_NO_CHECKSUM;
+#ifdef OPEN_THREADS_SHFT
+    m.attr("OPEN_THREADS_SHFT") = OPEN_THREADS_SHFT;
+    m.attr("OPEN_THREADS_MASK") = OPEN_THREADS_MASK;
+#endif
     m.attr("MODE_WVC") = MODE_WVC;
     m.attr("MODE_LOSSLESS") = MODE_LOSSLESS;
     m.attr("MODE_HYBRID") = MODE_HYBRID;
@@ -5,3 +5,459 @@ print(E.GetLibraryVersionString())
 array, rate = E.read("test.wv")
 print(array.shape)
 
+
+window, rate = E.read("test.wv", start=10, frames=100)
+print(window.shape)
+assert (window == array[10:110]).all()
+
+results = E.read_many(["test.wv", "test.wv"], num_threads=2)
+assert len(results) == 2
+assert (results[1][0] == array).all()
+
+import numpy as np
+with E.WavpackRead("test.wv") as f:
+    bytes_per_sample = f.GetBytesPerSample()
+    is_float = f.GetMode() & E.MODE_FLOAT
+if not is_float:
+    array_f32, _ = E.read("test.wv", dtype=np.float32)
+    assert array_f32.dtype == np.float32
+    np.testing.assert_allclose(array_f32, array / 2.0 ** (bytes_per_sample * 8 - 1))
+    array_i16, _ = E.read("test.wv", dtype="int16")
+    assert array_i16.dtype == np.int16
+    # Integers are narrowed by dropping the LSBs (or widened by shifting left)
+    shift = bytes_per_sample * 8 - 16
+    expected = array >> shift if shift >= 0 else array << -shift
+    assert (array_i16 == expected.astype(np.int16)).all()
+
+with open("test.wv", "rb") as f:
+    data = f.read()
+array_bytes, rate_bytes = E.read_bytes(memoryview(data))
+assert rate_bytes == rate
+assert (array_bytes == array).all()
+with E.WavpackRead(data) as f:
+    assert f.GetNumSamples64() == array.shape[0]
+
+with E.WavpackRead("test.wv") as f:
+    buf = np.empty((100, f.GetNumChannels()), dtype=np.int32)
+    assert f.readinto(buf) == 100
+    assert (buf == array[:100]).all()
+    chunks = [chunk.copy() for chunk in f.iter_blocks(100, out=buf)]
+    assert (np.concatenate([buf[:0]] + chunks) == array[100:]).all()
+
+import os
+import struct
+import tempfile
+with tempfile.TemporaryDirectory() as d:
+    path = os.path.join(d, "write.wv")
+    source = (np.random.randn(10000, 2) * 1000).astype(np.int16)
+    E.write(path, source, 16000, mode="high", md5=True)
+    decoded, decoded_rate = E.read(path, dtype=np.int16)
+    assert decoded_rate == 16000
+    assert (decoded == source).all()
+
+    with E.WavpackWrite(path, 16000, 2, bits_per_sample=16) as f:
+        for chunk in np.array_split(source, 7):
+            f.write(chunk)
+    decoded, _ = E.read(path, dtype=np.int16)
+    assert (decoded == source).all()
+
+    paths = [os.path.join(d, f"many{i}.wv") for i in range(3)]
+    E.write_many(paths[:2], [source, source[:100]], 16000, mode="fast", num_threads=2)
+    E.write_many(paths[2:], [paths[0]], mode="high", extra=2)
+    decoded, _ = E.read(paths[2], dtype=np.int16)
+    assert (decoded == source).all()
+    assert E.read(paths[1])[0].shape == (100, 2)
+
+    E.write(path, source, 16000, bitrate=3.0, wvc=True)
+    assert os.path.exists(path + "c")
+    decoded, _ = E.read(path, dtype=np.int16)
+    assert (decoded == source).all()
+
+    # int16 is full scale, so it's shifted into the 24-bit container
+    E.write(path, source, 16000, bits_per_sample=24)
+    decoded, _ = E.read(path)
+    assert (decoded == source.astype(np.int32) * 256).all()
+    try:
+        E.write(path, np.array([[1 << 20, 0]], dtype=np.int32), 16000, bits_per_sample=16)
+        assert False
+    except ValueError:
+        pass
+    # The number of bits used in int32 can't be inferred
+    try:
+        E.write(path, source.astype(np.int32), 16000)
+        assert False
+    except ValueError:
+        pass
+
+    # Floats are clamped before rounding, and NaN becomes the minimum
+    floats = np.array([[np.nan, np.inf], [-np.inf, 2.0], [-2.0, 0.75 / 32768],
+                       [-0.25 / 32768, 100.4 / 32768]], dtype=np.float32)
+    E.write(path, floats, 16000)
+    decoded, _ = E.read(path, dtype=np.int16)
+    assert decoded.tolist() == [[-32768, 32767], [-32768, 32767], [-32768, 1], [0, 100]]
+
+with tempfile.TemporaryDirectory() as d:
+    sidecar = os.path.join(d, "test.wv.idx")
+    index = E.get_seek_index("test.wv", sidecar=sidecar)
+    assert index.total_samples == array.shape[0]
+    assert os.path.exists(sidecar)
+    assert len(E.WavpackSeekIndex.load(sidecar)) == len(index)
+    assert os.listdir(d) == ["test.wv.idx"]
+    # A broken count must be rejected without allocating for it
+    data = bytearray(open(sidecar, "rb").read())
+    data[32:40] = struct.pack("<Q", 1 << 62)
+    open(os.path.join(d, "broken.idx"), "wb").write(data)
+    try:
+        E.WavpackSeekIndex.load(os.path.join(d, "broken.idx"))
+        assert False
+    except RuntimeError:
+        pass
+    for start in [0, 1, array.shape[0] // 3, array.shape[0] - 5]:
+        windowed, _ = E.read("test.wv", start=start, frames=1000, use_index=True)
+        assert (windowed == array[start:start + 1000]).all()
+    with E.WavpackRead("test.wv") as f:
+        f.SetSeekIndex(index)
+        assert f.SeekSample64(array.shape[0] // 2)
+        assert f.GetSampleIndex64() == array.shape[0] // 2
+    E.clear_seek_index_cache()
+
+offsets = [0, 10, array.shape[0] // 2, array.shape[0] - 50]
+crops = E.read_crops(["test.wv"] * 4, offsets, 100, pad=True)
+assert crops.shape == (4, 100, array.shape[1])
+for crop, offset in zip(crops, offsets):
+    valid = min(100, array.shape[0] - offset)
+    assert (crop[:valid] == array[offset:offset + valid]).all()
+    assert (crop[valid:] == 0).all()
+out = np.empty((2, 100, array.shape[1]), dtype=np.float32)
+assert E.read_crops(["test.wv"] * 2, offsets[:2], 100, out=out, use_index=True) is out
+try:
+    E.read_crops(["test.wv"], [array.shape[0] - 50], 100)
+    assert False
+except RuntimeError:
+    pass
+
+info = E.info("test.wv")
+assert E.info("test.wv", md5=False).md5 == ""
+assert info.num_samples == array.shape[0]
+assert info.sample_rate == rate
+assert info.channels == array.shape[1]
+columns = E.info_many(["test.wv", "missing.wv"], md5=True, errors="ignore")
+assert list(columns["ok"]) == [True, False]
+assert columns["num_samples"][0] == array.shape[0]
+assert columns["md5"] == [info.md5, ""]
+
+with tempfile.TemporaryDirectory() as d:
+    path = os.path.join(d, "long.wv")
+    # Long enough to be split into 4 segments of at least 1 << 18 frames
+    source = (np.random.randn(1200000, 3) * 1000).astype(np.int16)
+    E.write(path, source, 16000)
+    for dtype in ["int32", "float32"]:
+        serial, _ = E.read(path, dtype=dtype)
+        parallel, _ = E.read(path, dtype=dtype, num_threads=4)
+        assert (serial == parallel).all()
+    parallel, _ = E.read(path, start=12345, frames=1000000, num_threads=4)
+    assert (parallel == source[12345:1012345]).all()
+
+with E.WavpackArray("test.wv") as a:
+    assert a.shape == array.shape
+    assert a.dtype == np.int32
+    assert (a[10:1000] == array[10:1000]).all()
+    assert (a[::-7, 1:] == array[::-7, 1:]).all()
+    assert (a[-1] == array[-1]).all()
+    assert a[5, 0] == array[5, 0]
+    assert (a[3:50:5, ::-1] == array[3:50:5, ::-1]).all()
+    assert (a[..., 0] == array[..., 0]).all()
+    try:
+        a[None]
+        assert False
+    except IndexError:
+        pass
+    assert (np.asarray(a) == array).all()
+    hits, misses, _, _ = a.cache_info()
+    assert hits > 0 and misses > 0
+
+E.configure_buffer_pool(enabled=True, max_bytes=64 << 20)
+for _ in range(3):
+    pooled, _ = E.read("test.wv", frames=1000)
+    assert (pooled == array[:1000]).all()
+    del pooled
+stats = E.buffer_pool_stats()
+assert stats["hits"] >= 2 and stats["cached_buffers"] >= 1
+assert E.trim_buffer_pool() > 0
+E.configure_buffer_pool(enabled=False)
+assert E.buffer_pool_stats()["cached_bytes"] == 0
+# Without the pool, arrays aren't pooled nor counted
+unpooled, _ = E.read("test.wv", frames=1000)
+assert E.buffer_pool_stats()["in_use_buffers"] == 0
+del unpooled
+
+import threading
+
+# Closing from another thread waits for the decoding without the GIL
+f = E.WavpackRead("test.wv")
+errors = []
+
+
+def drain():
+    try:
+        for _ in f.iter_blocks(100):
+            pass
+    except RuntimeError as e:
+        errors.append(e)
+
+
+t = threading.Thread(target=drain)
+t.start()
+f.CloseFile()
+t.join()
+assert all("closed" in str(e) for e in errors)
+try:
+    f.readinto(np.empty((10, array.shape[1]), dtype=np.int32))
+    assert False
+except RuntimeError:
+    pass
+
+import asyncio
+from pywavpack import aio
+
+
+async def test_aio():
+    decoded, decoded_rate = await aio.aread("test.wv", start=10, frames=100)
+    assert decoded_rate == rate
+    assert (decoded == array[10:110]).all()
+    results = await asyncio.gather(*[aio.aread("test.wv") for _ in range(8)])
+    assert all((r[0] == array).all() for r in results)
+    try:
+        await aio.aread("missing.wv")
+        assert False
+    except RuntimeError:
+        pass
+
+    chunks = [c async for c in aio.AsyncWavpackRead("test.wv").iter_blocks(1000, prefetch=2)]
+    assert (np.concatenate(chunks) == array).all()
+
+
+asyncio.run(test_aio())
+
+# A prefetcher left open is stopped at exit before the interpreter finalizes
+import subprocess
+import sys
+subprocess.run([sys.executable, "-c", """
+import pywavpack.pywavpack_ext as E
+prefetcher = E.BlockPrefetcher("test.wv", 100, lambda: None, prefetch=1)
+"""], check=True)
+
+report = E.verify("test.wv")
+assert report.ok, report
+assert report.decoded_samples == array.shape[0]
+assert report.first_bad_offset == -1
+with tempfile.TemporaryDirectory() as d:
+    path = os.path.join(d, "verify.wv")
+    source = (np.random.randn(100000, 2) * 1000).astype(np.int16)
+    E.write(path, source, 16000, md5=True)
+    report = E.verify(path)
+    assert report.ok and report.md5 == report.computed_md5 != ""
+
+    data = bytearray(open(path, "rb").read())
+    data[len(data) // 2] ^= 0xFF
+    broken = os.path.join(d, "broken.wv")
+    open(broken, "wb").write(data)
+    reports = E.verify_many([path, broken, "missing.wv"], num_threads=2)
+    assert [r.ok for r in reports] == [True, False, False]
+    # The offset of the block with the flipped byte, not of an earlier one
+    # (looked up in the intact file, in case the header itself was hit)
+    offset = reports[1].first_bad_offset
+    intact = open(path, "rb").read()
+    assert intact[offset:offset + 4] == b"wvpk"
+    assert offset <= len(data) // 2 < offset + 8 + struct.unpack("<I", intact[offset + 4:offset + 8])[0]
+    # A failed re-encoding leaves neither the output nor a temporary file
+    try:
+        E.write_many([os.path.join(d, "rewritten.wv")], [broken])
+        assert False
+    except RuntimeError:
+        pass
+    assert not [name for name in os.listdir(d) if name.startswith("rewritten")]
+    assert reports[2].error != ""
+
+planar, _ = E.read("test.wv", layout="planar")
+assert planar.shape == array.T.shape and (planar == array.T).all()
+selected, _ = E.read("test.wv", channels=[-1, 0], start=5, frames=100, dtype="float32")
+reference, _ = E.read("test.wv", start=5, frames=100, dtype="float32")
+assert (selected == reference[:, [-1, 0]]).all()
+planar, _ = E.read("test.wv", channels=1, layout="planar")
+assert planar.shape == (1, array.shape[0]) and (planar[0] == array[:, 1]).all()
+try:
+    E.read("test.wv", channels=[array.shape[1]])
+    assert False
+except ValueError:
+    pass
+
+with tempfile.TemporaryDirectory() as d:
+    path = os.path.join(d, "test.wvs")
+    sidecar = os.path.join(d, "test.wvsi")
+    clips = [(np.random.randn(1000 * (i + 1), 2) * 1000).astype(np.int16) for i in range(3)]
+    with E.ShardWriter(path, sidecar=sidecar) as w:
+        w.add("first", clips[0], 16000)
+        w.add("file", "test.wv")
+        w.add_many(["second", "third"], clips[1:], 16000, num_threads=2)
+        try:
+            w.add("first", clips[0], 16000)
+            assert False
+        except ValueError:
+            pass
+        try:
+            w.add_many(["fourth", "fourth"], clips[:2], 16000)
+            assert False
+        except ValueError:
+            pass
+        assert len(w) == 4
+    for index in [None, sidecar]:
+        with E.ShardReader(path, sidecar=index or "") as r:
+            assert r.keys() == ["first", "file", "second", "third"]
+            assert len(r) == 4 and "file" in r and "missing" not in r
+            assert r.info("third")["num_samples"] == 3000
+            decoded, rate = r.read("file")
+            assert rate == E.read("test.wv")[1] and (decoded == array).all()
+            decoded, rate = r.read(-1, start=10, frames=100)
+            assert rate == 16000 and (decoded == clips[2][10:110]).all()
+            results = r.read_many(["first", "second", 2], num_threads=2)
+            for (decoded, _), clip in zip(results, [clips[0], clips[1], clips[1]]):
+                assert (decoded == clip).all()
+            try:
+                r.read("missing")
+                assert False
+            except KeyError:
+                pass
+
+import hashlib
+import wave
+
+with tempfile.TemporaryDirectory() as d:
+    paths = []
+    for sampwidth in [1, 2, 3]:
+        path = os.path.join(d, f"pcm{sampwidth}.wav")
+        with wave.open(path, "wb") as w:
+            w.setnchannels(2)
+            w.setsampwidth(sampwidth)
+            w.setframerate(22050)
+            w.writeframes(np.random.randint(0, 256, 3001 * 2 * sampwidth, dtype=np.uint8).tobytes())
+        # A trailing chunk, which must be kept as it is
+        data = bytearray(open(path, "rb").read())
+        if len(data) % 2:
+            data += b"\0"
+        data += b"LIST" + struct.pack("<I", 4) + b"INFO"
+        data[4:8] = struct.pack("<I", len(data) - 8)
+        open(path, "wb").write(data)
+        paths.append(path)
+
+    E.compress_file(paths[0], os.path.join(d, "pcm1.wv"), md5=True, chunk_frames=1000)
+    pcm = open(paths[0], "rb").read()[44:44 + 3001 * 2]
+    assert E.info(os.path.join(d, "pcm1.wv")).md5 == hashlib.md5(pcm).hexdigest()
+    E.decompress_file(os.path.join(d, "pcm1.wv"), os.path.join(d, "out1.wav"), chunk_frames=700)
+    assert open(os.path.join(d, "out1.wav"), "rb").read() == open(paths[0], "rb").read()
+
+    wvs = [p[:-4] + ".wv" for p in paths]
+    outs = [p[:-4] + ".out.wav" for p in paths]
+    E.compress_many(paths, wvs, md5=True, num_threads=2)
+    E.decompress_many(wvs, outs, num_threads=2)
+    for path, out in zip(paths, outs):
+        assert open(path, "rb").read() == open(out, "rb").read()
+    decoded, rate = E.read(wvs[1])
+    assert rate == 22050 and decoded.shape == (3001, 2)
+
+    os.mkdir(os.path.join(d, "captures"))
+    for path in paths:
+        open(os.path.join(d, "captures", os.path.basename(path)), "wb").write(open(path, "rb").read())
+    open(os.path.join(d, "captures", "notes.txt"), "w").write("skipped")
+    wvs = E.compress_dir(os.path.join(d, "captures"), os.path.join(d, "compressed"), num_threads=2)
+    assert [os.path.basename(p) for p in wvs] == ["pcm1.wv", "pcm2.wv", "pcm3.wv"]
+    outs = E.decompress_dir(os.path.join(d, "compressed"), os.path.join(d, "restored"))
+    for path, out in zip(paths, outs):
+        assert os.path.basename(out) == os.path.basename(path)
+        assert open(path, "rb").read() == open(out, "rb").read()
+
+    # Big-endian CAF, where the checksum is of the big-endian and signed
+    # 8-bit samples as stored in the file
+    for sampwidth in [1, 2]:
+        path = os.path.join(d, f"pcm{sampwidth}.caf")
+        pcm = np.random.randint(0, 256, 3001 * 2 * sampwidth, dtype=np.uint8).tobytes()
+        desc = struct.pack(">d4sIIIII", 22050.0, b"lpcm", 0, 2 * sampwidth, 1, 2, 8 * sampwidth)
+        with open(path, "wb") as f:
+            f.write(b"caff" + struct.pack(">HH", 1, 0))
+            f.write(b"desc" + struct.pack(">q", len(desc)) + desc)
+            f.write(b"data" + struct.pack(">qI", len(pcm) + 4, 0) + pcm)
+        E.compress_file(path, path[:-4] + ".caf.wv", md5=True)
+        report = E.verify(path[:-4] + ".caf.wv")
+        assert report.ok and report.md5 == report.computed_md5 != "", report
+        E.decompress_file(path[:-4] + ".caf.wv", path + ".out")
+        assert open(path + ".out", "rb").read() == open(path, "rb").read()
+
+    # Wave64, whose chunks are 8-byte aligned and identified by GUIDs
+    guid = bytes([0xF3, 0xAC, 0xD3, 0x11, 0x8C, 0xD1, 0x00, 0xC0, 0x4F, 0x8E, 0xDB, 0x8A])
+    riff = bytes([0x2E, 0x91, 0xCF, 0x11, 0xA5, 0xD6, 0x28, 0xDB, 0x04, 0xC1, 0x00, 0x00])
+    pcm = np.random.randint(0, 256, 3001 * 2 * 3, dtype=np.uint8).tobytes()
+    fmt = struct.pack("<HHIIHH", 1, 2, 22050, 22050 * 6, 6, 24)
+    body = b"wave" + guid
+    body += b"fmt " + guid + struct.pack("<Q", 24 + len(fmt)) + fmt + b"\0" * (-len(fmt) % 8)
+    body += b"data" + guid + struct.pack("<Q", 24 + len(pcm)) + pcm + b"\0" * (-len(pcm) % 8)
+    path = os.path.join(d, "pcm3.w64")
+    open(path, "wb").write(b"riff" + riff + struct.pack("<Q", 24 + len(body)) + body)
+    E.compress_file(path, path[:-4] + ".w64.wv", md5=True)
+    E.decompress_file(path[:-4] + ".w64.wv", path + ".out")
+    assert open(path + ".out", "rb").read() == open(path, "rb").read()
+    decoded, rate = E.read(path[:-4] + ".w64.wv")
+    assert rate == 22050 and decoded.shape == (3001, 2)
+
+    # A generated header for a file without the wrapper, whose odd-sized
+    # data chunk is followed by the pad byte
+    source = np.random.randint(-128, 128, (1001, 1)).astype(np.int32)
+    E.write(os.path.join(d, "odd.wv"), source, 8000, bits_per_sample=8)
+    E.decompress_file(os.path.join(d, "odd.wv"), os.path.join(d, "odd.wav"))
+    data = open(os.path.join(d, "odd.wav"), "rb").read()
+    assert struct.unpack("<I", data[4:8])[0] == len(data) - 8 and len(data) % 2 == 0
+    with wave.open(os.path.join(d, "odd.wav"), "rb") as w:
+        assert (np.frombuffer(w.readframes(1001), dtype=np.uint8) == source[:, 0] + 128).all()
+
+    out = os.path.join(d, "test.wav")
+    E.decompress_file("test.wv", out)
+    assert open(out, "rb").read(4) == b"RIFF"
+    E.compress_file(out, os.path.join(d, "test.wv"))
+    assert (E.read(os.path.join(d, "test.wv"))[0] == array).all()
+
+with tempfile.TemporaryDirectory() as d:
+    path = os.path.join(d, "analyze.wv")
+    source = (np.random.randn(10000, 3) * 3000).astype(np.int16)
+    source[5, 1] = 32767
+    source[7, 1] = -32768
+    source[:, 2] += 1000
+    E.write(path, source, 16000)
+    normalized = source / 32768.0
+    stats = E.analyze(path, bins=64)
+    assert stats["num_samples"] == 10000 and stats["sample_rate"] == 16000
+    np.testing.assert_allclose(stats["peak"], np.abs(normalized).max(axis=0))
+    np.testing.assert_allclose(stats["rms"], np.sqrt((normalized ** 2).mean(axis=0)))
+    np.testing.assert_allclose(stats["dc"], normalized.mean(axis=0), atol=1e-12)
+    assert list(stats["clipped"]) == [0, 2, 0]
+    assert stats["histogram"].shape == (3, 64)
+    assert (stats["histogram"].sum(axis=1) == 10000).all()
+    for c in range(3):
+        expected, _ = np.histogram(normalized[:, c], bins=64, range=(-1, 1))
+        assert (np.abs(stats["histogram"][c] - expected) <= 1).all()
+
+    (stats2, (decoded, rate)) = E.analyze(path, return_array=True, dtype="int16")
+    assert rate == 16000 and (decoded == source).all()
+    results = E.analyze_many([path, "test.wv"], num_threads=2)
+    assert results[0]["clipped"][1] == 2
+    assert results[1]["num_samples"] == array.shape[0]
+
+E.reset_stats()
+E.read("test.wv", dtype="float32")
+E.read("test.wv", start=100, frames=10)
+stats = E.stats()
+assert stats["files_opened"] == 2
+assert stats["samples_decoded"] == array.shape[0] + 10
+assert stats["seeks"] == 1
+assert stats["blocks_decoded"] >= 2
+assert stats["bytes_read"] > 0 and stats["unpack_ns"] > 0 and stats["convert_ns"] > 0
+E.reset_stats()
+assert all(v == 0 for v in E.stats().values())